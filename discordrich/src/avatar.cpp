@@ -0,0 +1,493 @@
+#include "avatar.h"
+#include "shutdown.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <dmsdk/image/image.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <sys/utime.h>
+#define utime _utime
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <utime.h>
+#endif
+
+#if defined(_WIN32)
+    #define SEP "\\"
+#else
+    #define SEP "/"
+#endif
+
+#define AVATAR_PREFIX "avatar-"
+#define AVATAR_EXT ".png"
+#define DEFAULT_BASE_URL "https://cdn.discordapp.com"
+#define DEFAULT_DISK_LIMIT (16 * 1024 * 1024)
+
+struct AvatarJob {
+    uint32_t id;
+    bool store;
+    char key[DISCORDRICH_AVATAR_KEY_MAX];
+    uint8_t * data;
+    size_t size;
+};
+
+struct CacheEntry {
+    char key[DISCORDRICH_AVATAR_KEY_MAX];
+    size_t size;
+    uint64_t lastUse;
+};
+
+// Everything the worker thread touches, so that a worker that misses the
+// shutdown deadline can be abandoned and a new one started after a reboot
+struct AvatarWorker {
+    dmMutex::HMutex mutex;
+    dmConditionVariable::HConditionVariable cond;
+    dmThread::Thread thread;
+    bool quit;
+    bool finished;
+    bool abandoned; // The thread frees the worker when it exits
+
+    dmArray<AvatarJob> jobs;
+    dmArray<DiscordRich_AvatarResult> results;
+
+    // Only touched by the worker thread
+    dmArray<CacheEntry> entries;
+    bool scanned;
+    size_t totalSize;
+    size_t diskLimit;
+};
+
+static struct {
+    AvatarWorker * worker;
+    uint32_t nextId;
+    size_t diskLimit;
+    char baseUrl[256];
+} cache;
+
+void DiscordRich_initAvatarCache(dmConfigFile::HConfig appConfig)
+{
+    const char * baseUrl = dmConfigFile::GetString(appConfig, "discordrich.avatar_base_url", DEFAULT_BASE_URL);
+    strncpy(cache.baseUrl, baseUrl, sizeof(cache.baseUrl) - 1);
+    cache.baseUrl[sizeof(cache.baseUrl) - 1] = 0;
+
+    size_t len = strlen(cache.baseUrl);
+    while (len && cache.baseUrl[len - 1] == '/') {
+        cache.baseUrl[--len] = 0;
+    }
+
+    int32_t diskLimit = dmConfigFile::GetInt(appConfig, "discordrich.avatar_cache_size", DEFAULT_DISK_LIMIT);
+    cache.diskLimit = diskLimit > 0 ? (size_t)diskLimit : 0;
+}
+
+bool DiscordRich_getAvatarUrl(char * buffer, size_t bufferSize, const char * userId, const char * avatar, int size)
+{
+    if (!avatar || !avatar[0] || !userId || !userId[0]) { return false; }
+    int len = snprintf(buffer, bufferSize, "%s/avatars/%s/%s" AVATAR_EXT "?size=%d", cache.baseUrl, userId, avatar, size);
+    return len > 0 && (size_t)len < bufferSize;
+}
+
+void DiscordRich_getAvatarKey(char * buffer, size_t bufferSize, const char * userId, const char * avatar, int size)
+{
+    snprintf(buffer, bufferSize, "%s-%s-%d", userId, avatar, size);
+    for (char * c = buffer; *c; c++) {
+        bool safe = (*c >= '0' && *c <= '9') || (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || *c == '-' || *c == '_';
+        if (!safe) { *c = '_'; }
+    }
+}
+
+// Worker thread
+
+static bool getEntryPath(char * buffer, size_t bufferSize, const char * key)
+{
+    char fileName[DISCORDRICH_AVATAR_KEY_MAX + 16];
+    snprintf(fileName, sizeof(fileName), AVATAR_PREFIX "%s" AVATAR_EXT, key);
+    return DiscordRich_getDataPath(buffer, bufferSize, fileName);
+}
+
+static void addEntry(AvatarWorker * w, const char * key, size_t size, uint64_t lastUse)
+{
+    if (w->entries.Full()) {
+        w->entries.OffsetCapacity(32);
+    }
+    CacheEntry entry;
+    strncpy(entry.key, key, sizeof(entry.key) - 1);
+    entry.key[sizeof(entry.key) - 1] = 0;
+    entry.size = size;
+    entry.lastUse = lastUse;
+    w->entries.Push(entry);
+    w->totalSize += size;
+}
+
+static CacheEntry * findEntry(AvatarWorker * w, const char * key, uint32_t * index)
+{
+    for (uint32_t i = 0; i < w->entries.Size(); i++) {
+        if (!strcmp(w->entries[i].key, key)) {
+            if (index) { *index = i; }
+            return &w->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void removeEntry(AvatarWorker * w, uint32_t index)
+{
+    w->totalSize -= w->entries[index].size;
+    w->entries.EraseSwap(index);
+}
+
+static void addScannedFile(AvatarWorker * w, const char * fileName, size_t size, uint64_t mtime)
+{
+    size_t prefixLen = strlen(AVATAR_PREFIX);
+    size_t extLen = strlen(AVATAR_EXT);
+    size_t len = strlen(fileName);
+    if (len <= prefixLen + extLen || len - prefixLen - extLen >= DISCORDRICH_AVATAR_KEY_MAX) { return; }
+    if (strncmp(fileName, AVATAR_PREFIX, prefixLen) || strcmp(fileName + len - extLen, AVATAR_EXT)) { return; }
+
+    char key[DISCORDRICH_AVATAR_KEY_MAX];
+    memcpy(key, fileName + prefixLen, len - prefixLen - extLen);
+    key[len - prefixLen - extLen] = 0;
+    addEntry(w, key, size, mtime);
+}
+
+static void scanDisk(AvatarWorker * w)
+{
+    w->scanned = true;
+
+    char dir[1024];
+    if (!DiscordRich_getDataPath(dir, sizeof(dir), NULL)) { return; }
+
+    #ifdef _WIN32
+    char pattern[1024 + 32];
+    snprintf(pattern, sizeof(pattern), "%s" SEP AVATAR_PREFIX "*" AVATAR_EXT, dir);
+
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA(pattern, &data);
+    if (find == INVALID_HANDLE_VALUE) { return; }
+    do {
+        uint64_t fileTime = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+        uint64_t mtime = fileTime / 10000000ULL - 11644473600ULL;
+        addScannedFile(w, data.cFileName, data.nFileSizeLow, mtime);
+    } while (FindNextFileA(find, &data));
+    FindClose(find);
+
+    #else
+    DIR * d = opendir(dir);
+    if (!d) { return; }
+    struct dirent * ent;
+    while ((ent = readdir(d))) {
+        char path[1024 + 256];
+        snprintf(path, sizeof(path), "%s" SEP "%s", dir, ent->d_name);
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            addScannedFile(w, ent->d_name, (size_t)st.st_size, (uint64_t)st.st_mtime);
+        }
+    }
+    closedir(d);
+    #endif
+}
+
+static void evict(AvatarWorker * w)
+{
+    while (w->totalSize > w->diskLimit && w->entries.Size()) {
+        uint32_t oldest = 0;
+        for (uint32_t i = 1; i < w->entries.Size(); i++) {
+            if (w->entries[i].lastUse < w->entries[oldest].lastUse) { oldest = i; }
+        }
+
+        char path[1024];
+        if (getEntryPath(path, sizeof(path), w->entries[oldest].key)) {
+            remove(path);
+        }
+        removeEntry(w, oldest);
+    }
+}
+
+// Reads the size from the PNG header, so oversized images are rejected before
+// the decoder allocates anything for them
+static bool checkImageSize(const uint8_t * data, size_t size)
+{
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    if (size < 24 || memcmp(data, signature, sizeof(signature)) || memcmp(data + 12, "IHDR", 4)) { return false; }
+
+    uint32_t width = ((uint32_t)data[16] << 24) | ((uint32_t)data[17] << 16) | ((uint32_t)data[18] << 8) | data[19];
+    uint32_t height = ((uint32_t)data[20] << 24) | ((uint32_t)data[21] << 16) | ((uint32_t)data[22] << 8) | data[23];
+    return width && height && width <= DISCORDRICH_AVATAR_MAX_SIZE && height <= DISCORDRICH_AVATAR_MAX_SIZE;
+}
+
+// Decodes with the engine's image loader and converts to RGBA8
+static void decode(const uint8_t * data, size_t size, DiscordRich_AvatarResult * result)
+{
+    result->status = DISCORDRICH_AVATAR_INVALID;
+
+    dmImage::HImage image = checkImageSize(data, size) ? dmImage::NewImage(data, (uint32_t)size, false) : NULL;
+    if (!image) {
+        dmLogWarning("Could not decode avatar");
+        return;
+    }
+
+    uint32_t width = dmImage::GetWidth(image);
+    uint32_t height = dmImage::GetHeight(image);
+    const uint8_t * src = (const uint8_t *)dmImage::GetData(image);
+
+    uint32_t channels = 0;
+    switch (dmImage::GetType(image)) {
+        case dmImage::TYPE_LUMINANCE: channels = 1; break;
+        case dmImage::TYPE_LUMINANCE_ALPHA: channels = 2; break;
+        case dmImage::TYPE_RGB: channels = 3; break;
+        case dmImage::TYPE_RGBA: channels = 4; break;
+        default: break;
+    }
+
+    if (src && channels && width && height && width <= DISCORDRICH_AVATAR_MAX_SIZE && height <= DISCORDRICH_AVATAR_MAX_SIZE) {
+        uint32_t count = width * height;
+        uint8_t * pixels = new uint8_t[count * 4];
+        for (uint32_t i = 0; i < count; i++, src += channels) {
+            uint8_t * dst = &pixels[i * 4];
+            if (channels <= 2) {
+                dst[0] = dst[1] = dst[2] = src[0];
+                dst[3] = channels == 2 ? src[1] : 255;
+            } else {
+                dst[0] = src[0];
+                dst[1] = src[1];
+                dst[2] = src[2];
+                dst[3] = channels == 4 ? src[3] : 255;
+            }
+        }
+        result->pixels = pixels;
+        result->width = width;
+        result->height = height;
+        result->status = DISCORDRICH_AVATAR_DECODED;
+    } else {
+        dmLogWarning("Unsupported avatar image");
+    }
+    dmImage::DeleteImage(image);
+}
+
+static void runLoad(AvatarWorker * w, AvatarJob * job, DiscordRich_AvatarResult * result)
+{
+    result->status = DISCORDRICH_AVATAR_MISSING;
+
+    uint32_t index;
+    CacheEntry * entry = findEntry(w, job->key, &index);
+    if (!entry) { return; }
+
+    char path[1024];
+    FILE * f = getEntryPath(path, sizeof(path), job->key) ? fopen(path, "rb") : NULL;
+    if (!f) {
+        removeEntry(w, index);
+        return;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t * data = size > 0 ? new uint8_t[size] : NULL;
+    size_t read = data ? fread(data, 1, size, f) : 0;
+    fclose(f);
+
+    decode(data, read, result);
+    delete[] data;
+
+    if (result->status != DISCORDRICH_AVATAR_DECODED) {
+        // Corrupt file. Download the avatar again
+        remove(path);
+        removeEntry(w, index);
+        result->status = DISCORDRICH_AVATAR_MISSING;
+        return;
+    }
+
+    // Keep the access time on disk so the LRU order survives restarts
+    entry->lastUse = (uint64_t)time(NULL);
+    utime(path, NULL);
+}
+
+static void runStore(AvatarWorker * w, AvatarJob * job, DiscordRich_AvatarResult * result)
+{
+    decode(job->data, job->size, result);
+    if (result->status != DISCORDRICH_AVATAR_DECODED || !w->diskLimit) { return; }
+
+    char path[1024];
+    if (!getEntryPath(path, sizeof(path), job->key)) { return; }
+
+    FILE * f = fopen(path, "wb");
+    if (!f) {
+        dmLogWarning("Could not write avatar cache file \"%s\"", path);
+        return;
+    }
+    size_t written = fwrite(job->data, 1, job->size, f);
+    fclose(f);
+
+    uint32_t index;
+    if (findEntry(w, job->key, &index)) { removeEntry(w, index); }
+    addEntry(w, job->key, written, (uint64_t)time(NULL));
+    evict(w);
+}
+
+static void freeWorker(AvatarWorker * w)
+{
+    for (uint32_t i = 0; i < w->jobs.Size(); i++) {
+        delete[] w->jobs[i].data;
+    }
+    for (uint32_t i = 0; i < w->results.Size(); i++) {
+        DiscordRich_freeAvatarResult(&w->results[i]);
+    }
+    dmConditionVariable::Delete(w->cond);
+    dmMutex::Delete(w->mutex);
+    delete w;
+}
+
+static void workerThread(void * arg)
+{
+    AvatarWorker * w = (AvatarWorker *)arg;
+    dmArray<AvatarJob> pending;
+
+    dmMutex::Lock(w->mutex);
+    while (true) {
+        while (!w->quit && w->jobs.Empty()) {
+            dmConditionVariable::Wait(w->cond, w->mutex);
+        }
+        if (w->jobs.Empty()) { break; }
+
+        pending.Swap(w->jobs);
+        dmMutex::Unlock(w->mutex);
+
+        if (!w->scanned) { scanDisk(w); }
+
+        for (uint32_t i = 0; i < pending.Size(); i++) {
+            AvatarJob * job = &pending[i];
+
+            DiscordRich_AvatarResult result;
+            memset(&result, 0, sizeof(result));
+            result.jobId = job->id;
+            if (job->store) {
+                runStore(w, job, &result);
+                delete[] job->data;
+            } else {
+                runLoad(w, job, &result);
+            }
+
+            DM_MUTEX_SCOPED_LOCK(w->mutex);
+            if (w->results.Full()) {
+                w->results.OffsetCapacity(16);
+            }
+            w->results.Push(result);
+        }
+        pending.SetSize(0);
+
+        dmMutex::Lock(w->mutex);
+    }
+    w->finished = true;
+    bool abandoned = w->abandoned;
+    dmMutex::Unlock(w->mutex);
+
+    // Nobody is waiting for an abandoned worker anymore
+    if (abandoned) { freeWorker(w); }
+}
+
+static uint32_t pushJob(bool store, const char * key, uint8_t * data, size_t size)
+{
+    AvatarWorker * w = cache.worker;
+    if (!w) {
+        w = new AvatarWorker;
+        w->mutex = dmMutex::New();
+        w->cond = dmConditionVariable::New();
+        w->quit = false;
+        w->finished = false;
+        w->abandoned = false;
+        w->scanned = false;
+        w->totalSize = 0;
+        w->diskLimit = cache.diskLimit;
+        w->thread = dmThread::New(workerThread, 0x80000, w, "discordrich_avatar");
+        cache.worker = w;
+    }
+
+    DM_MUTEX_SCOPED_LOCK(w->mutex);
+
+    cache.nextId += 1;
+    if (!cache.nextId) { cache.nextId = 1; }
+
+    AvatarJob job;
+    job.id = cache.nextId;
+    job.store = store;
+    strncpy(job.key, key, sizeof(job.key) - 1);
+    job.key[sizeof(job.key) - 1] = 0;
+    job.data = data;
+    job.size = size;
+
+    if (w->jobs.Full()) {
+        w->jobs.OffsetCapacity(16);
+    }
+    w->jobs.Push(job);
+    dmConditionVariable::Signal(w->cond);
+
+    return job.id;
+}
+
+uint32_t DiscordRich_loadAvatar(const char * key)
+{
+    return pushJob(false, key, NULL, 0);
+}
+
+uint32_t DiscordRich_storeAvatar(const char * key, const void * data, size_t size)
+{
+    uint8_t * copy = new uint8_t[size];
+    memcpy(copy, data, size);
+    return pushJob(true, key, copy, size);
+}
+
+bool DiscordRich_pollAvatar(DiscordRich_AvatarResult * result)
+{
+    AvatarWorker * w = cache.worker;
+    if (!w) { return false; }
+    DM_MUTEX_SCOPED_LOCK(w->mutex);
+
+    if (w->results.Empty()) { return false; }
+    *result = w->results[0];
+    w->results.EraseSwap(0);
+    return true;
+}
+
+void DiscordRich_freeAvatarResult(DiscordRich_AvatarResult * result)
+{
+    delete[] result->pixels;
+    result->pixels = NULL;
+}
+
+bool DiscordRich_finalizeAvatarCache(uint64_t deadline)
+{
+    AvatarWorker * w = cache.worker;
+    if (!w) { return true; }
+    cache.worker = NULL;
+
+    // The worker finishes the queued jobs before it exits
+    dmMutex::Lock(w->mutex);
+    w->quit = true;
+    dmConditionVariable::Signal(w->cond);
+    dmMutex::Unlock(w->mutex);
+
+    bool finished = DiscordRich_waitForFlag(w->mutex, &w->finished, deadline);
+    if (!finished) {
+        // Checked again under the lock, in case the worker just finished
+        dmMutex::Lock(w->mutex);
+        finished = w->finished;
+        w->abandoned = !finished;
+        dmMutex::Unlock(w->mutex);
+    }
+    if (!finished) {
+        dmLogWarning("The avatar cache did not finish in time. Abandoning it");
+        return false;
+    }
+
+    dmThread::Join(w->thread);
+    freeWorker(w);
+    return true;
+}
+
+#endif
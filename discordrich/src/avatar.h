@@ -0,0 +1,47 @@
+#ifndef _AVATAR_H_
+#define _AVATAR_H_
+
+#include "common.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+#define DISCORDRICH_AVATAR_KEY_MAX 128
+// Sizes the CDN serves (powers of 2)
+#define DISCORDRICH_AVATAR_MIN_SIZE 16
+#define DISCORDRICH_AVATAR_MAX_SIZE 4096
+
+enum DiscordRich_AvatarStatus {
+    DISCORDRICH_AVATAR_DECODED = 0,
+    DISCORDRICH_AVATAR_MISSING = 1, // Not in the disk cache
+    DISCORDRICH_AVATAR_INVALID = 2, // Downloaded data that could not be decoded
+};
+
+struct DiscordRich_AvatarResult {
+    uint32_t jobId;
+    int status;
+    uint8_t * pixels; // RGBA8, top row first
+    uint32_t width;
+    uint32_t height;
+};
+
+void DiscordRich_initAvatarCache(dmConfigFile::HConfig appConfig);
+// Returns false if the worker was still busy at deadline (in dmTime::GetTime()
+// microseconds). It is then abandoned and frees itself when it finishes
+bool DiscordRich_finalizeAvatarCache(uint64_t deadline);
+
+// Builds the CDN url of an avatar and the key it is cached under
+bool DiscordRich_getAvatarUrl(char * buffer, size_t bufferSize, const char * userId, const char * avatar, int size);
+void DiscordRich_getAvatarKey(char * buffer, size_t bufferSize, const char * userId, const char * avatar, int size);
+
+// Disk cache. Reads, writes and decoding (with the engine's image loader)
+// happen on a worker thread.
+// Both report the decoded image back through DiscordRich_pollAvatar()
+uint32_t DiscordRich_loadAvatar(const char * key);
+// Decodes downloaded data and stores it on disk if it is a valid image
+uint32_t DiscordRich_storeAvatar(const char * key, const void * data, size_t size);
+
+bool DiscordRich_pollAvatar(DiscordRich_AvatarResult * result);
+void DiscordRich_freeAvatarResult(DiscordRich_AvatarResult * result);
+
+#endif
+#endif
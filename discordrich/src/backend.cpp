@@ -0,0 +1,185 @@
+#include "backend.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+#include <string.h>
+
+static const DiscordRich_Backend nullBackend = {
+    "null",
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+};
+
+const DiscordRich_Backend * DiscordRich_backend = &nullBackend;
+
+// Library backend. Filled in once the symbols are loaded
+
+static DiscordRich_Backend libraryBackend;
+static bool libraryLoaded = false;
+
+static void selectLibraryBackend(dmConfigFile::HConfig appConfig)
+{
+    DiscordRich_openLibrary(appConfig);
+    libraryLoaded = true;
+
+    libraryBackend.name = "library";
+    libraryBackend.initialize = sym_Discord_Initialize;
+    libraryBackend.shutdown = sym_Discord_Shutdown;
+    libraryBackend.runCallbacks = sym_Discord_RunCallbacks;
+    libraryBackend.updatePresence = sym_Discord_UpdatePresence;
+    libraryBackend.clearPresence = sym_Discord_ClearPresence;
+    libraryBackend.respond = sym_Discord_Respond;
+    libraryBackend.updateHandlers = sym_Discord_UpdateHandlers;
+    libraryBackend.registerCommand = sym_Discord_Register;
+    libraryBackend.registerSteamGame = sym_Discord_RegisterSteamGame;
+    DiscordRich_backend = &libraryBackend;
+}
+
+// Recording backend
+
+static struct {
+    dmMutex::HMutex mutex;
+    DiscordRich_RecordedCalls calls;
+    DiscordEventHandlers handlers;
+    bool readyPending;
+} recording;
+
+static void recordInitialize(const char * applicationId, DiscordEventHandlers * handlers, int, const char *)
+{
+    DM_MUTEX_SCOPED_LOCK(recording.mutex);
+    recording.calls.initialize += 1;
+    strncpy(recording.calls.applicationId, applicationId, sizeof(recording.calls.applicationId) - 1);
+    recording.calls.applicationId[sizeof(recording.calls.applicationId) - 1] = 0;
+    recording.handlers = *handlers;
+    recording.readyPending = true;
+}
+
+static void recordShutdown()
+{
+    DM_MUTEX_SCOPED_LOCK(recording.mutex);
+    recording.calls.shutdown += 1;
+    memset(&recording.handlers, 0, sizeof(recording.handlers));
+    recording.readyPending = false;
+}
+
+static void recordRunCallbacks()
+{
+    dmMutex::Lock(recording.mutex);
+    recording.calls.runCallbacks += 1;
+    bool ready = recording.readyPending;
+    recording.readyPending = false;
+    void (*readyHandler)(const DiscordUser *) = recording.handlers.ready;
+    dmMutex::Unlock(recording.mutex);
+
+    // Connect right away, like a local Discord client would
+    if (ready && readyHandler) {
+        DiscordUser user;
+        user.userId = "0";
+        user.username = "recording";
+        user.discriminator = "0000";
+        user.avatar = NULL;
+        readyHandler(&user);
+    }
+}
+
+static void recordUpdatePresence(const DiscordRichPresence * presence)
+{
+    DM_MUTEX_SCOPED_LOCK(recording.mutex);
+    recording.calls.updatePresence += 1;
+    recording.calls.hasPresence = true;
+    DiscordRich_presenceToFields(presence, &recording.calls.presence);
+}
+
+static void recordClearPresence()
+{
+    DM_MUTEX_SCOPED_LOCK(recording.mutex);
+    recording.calls.clearPresence += 1;
+    recording.calls.hasPresence = false;
+}
+
+static void recordRespond(const char *, int)
+{
+    DM_MUTEX_SCOPED_LOCK(recording.mutex);
+    recording.calls.respond += 1;
+}
+
+static void recordUpdateHandlers(DiscordEventHandlers * handlers)
+{
+    DM_MUTEX_SCOPED_LOCK(recording.mutex);
+    recording.calls.updateHandlers += 1;
+    recording.handlers = *handlers;
+}
+
+static void recordRegisterCommand(const char *, const char *)
+{
+    DM_MUTEX_SCOPED_LOCK(recording.mutex);
+    recording.calls.registerCommand += 1;
+}
+
+static void recordRegisterSteamGame(const char *, const char *)
+{
+    DM_MUTEX_SCOPED_LOCK(recording.mutex);
+    recording.calls.registerSteamGame += 1;
+}
+
+static const DiscordRich_Backend recordingBackend = {
+    "recording",
+    recordInitialize,
+    recordShutdown,
+    recordRunCallbacks,
+    recordUpdatePresence,
+    recordClearPresence,
+    recordRespond,
+    recordUpdateHandlers,
+    recordRegisterCommand,
+    recordRegisterSteamGame,
+};
+
+bool DiscordRich_isRecordingBackend()
+{
+    return DiscordRich_backend == &recordingBackend;
+}
+
+void DiscordRich_getRecordedCalls(DiscordRich_RecordedCalls * calls, bool reset)
+{
+    if (!recording.mutex) {
+        memset(calls, 0, sizeof(*calls));
+        return;
+    }
+
+    DM_MUTEX_SCOPED_LOCK(recording.mutex);
+    memcpy(calls, &recording.calls, sizeof(*calls));
+    if (reset) {
+        memset(&recording.calls, 0, sizeof(recording.calls));
+    }
+}
+
+// Selection
+
+void DiscordRich_selectBackend(dmConfigFile::HConfig appConfig)
+{
+    const char * name = dmConfigFile::GetString(appConfig, "discordrich.backend", "library");
+
+    if (!strcmp(name, "null")) {
+        DiscordRich_backend = &nullBackend;
+    } else if (!strcmp(name, "recording")) {
+        if (!recording.mutex) { recording.mutex = dmMutex::New(); }
+        memset(&recording.calls, 0, sizeof(recording.calls));
+        DiscordRich_backend = &recordingBackend;
+    } else {
+        if (strcmp(name, "library")) {
+            dmLogWarning("Unknown discordrich.backend \"%s\". Using \"library\"", name);
+        }
+        selectLibraryBackend(appConfig);
+    }
+}
+
+void DiscordRich_releaseBackend(bool unload)
+{
+    if (libraryLoaded) {
+        DiscordRich_closeLibrary(unload);
+        libraryLoaded = false;
+    }
+    DiscordRich_backend = &nullBackend;
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef _BACKEND_H_
+#define _BACKEND_H_
+
+#include "common.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+#include "presence.h"
+
+// Everything the extension calls into Discord RPC goes through a backend.
+// Entries can be NULL, in which case the call is skipped.
+struct DiscordRich_Backend {
+    const char * name;
+    void (*initialize)(const char * applicationId, DiscordEventHandlers * handlers, int autoRegister, const char * optionalSteamId);
+    void (*shutdown)(void);
+    void (*runCallbacks)(void);
+    void (*updatePresence)(const DiscordRichPresence * presence);
+    void (*clearPresence)(void);
+    void (*respond)(const char * userId, int reply);
+    void (*updateHandlers)(DiscordEventHandlers * handlers);
+    void (*registerCommand)(const char * applicationId, const char * command);
+    void (*registerSteamGame)(const char * applicationId, const char * steamId);
+};
+
+// Never NULL. Defaults to the null backend until DiscordRich_selectBackend()
+extern const DiscordRich_Backend * DiscordRich_backend;
+
+// Picks the backend from discordrich.backend in game.project:
+//   "library" (default): the Discord RPC library (loaded with dlopen unless statically linked)
+//   "null": does nothing and loads nothing. For dedicated servers and CI
+//   "recording": keeps track of the calls in memory. For tests
+void DiscordRich_selectBackend(dmConfigFile::HConfig appConfig);
+
+// Unloads the library if the library backend is in use. See DiscordRich_closeLibrary()
+void DiscordRich_releaseBackend(bool unload);
+
+// Recording backend
+
+struct DiscordRich_RecordedCalls {
+    uint32_t initialize;
+    uint32_t shutdown;
+    uint32_t runCallbacks;
+    uint32_t updatePresence;
+    uint32_t clearPresence;
+    uint32_t respond;
+    uint32_t updateHandlers;
+    uint32_t registerCommand;
+    uint32_t registerSteamGame;
+    char applicationId[64];
+    bool hasPresence;
+    DiscordRich_PresenceFields presence; // The last presence sent
+};
+
+bool DiscordRich_isRecordingBackend();
+// Copies the calls recorded so far and resets them if reset is set
+void DiscordRich_getRecordedCalls(DiscordRich_RecordedCalls * calls, bool reset);
+
+#endif
+#endif
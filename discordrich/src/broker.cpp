@@ -0,0 +1,486 @@
+#include "broker.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+#include "presence.h"
+
+#ifdef __linux__
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BROKER_MAGIC 0x52425244 // "DRBR"
+#define BROKER_VERSION 3
+#define BROKER_PROCESS_SLOTS 16
+#define BROKER_EVENT_SLOTS 32
+#define BROKER_RESPOND_SLOTS 8
+#define BROKER_LIVENESS_INTERVAL 250000
+#define BROKER_OPEN_TIMEOUT 1000000
+
+struct BrokerRespond {
+    char userId[32];
+    int reply;
+};
+
+// Every process publishes a patch: the fields it sets. The owner merges them
+// field by field, the most recently published value of each field winning
+struct BrokerProcess {
+    int32_t pid;
+    uint32_t presenceOrder; // BrokerShared::presenceVersion when the patch was published
+    DiscordRich_PresenceFields presence;
+};
+
+struct BrokerShared {
+    uint32_t magic;
+    uint32_t version;
+    pthread_mutex_t mutex; // Robust, so a process dying while holding it doesn't block the others
+
+    // Attached processes. Processes that died without closing the broker are
+    // pruned on the next open, close or take over, so the last live process unlinks it
+    BrokerProcess processes[BROKER_PROCESS_SLOTS];
+
+    int32_t ownerPid;
+    uint32_t ownerEpoch;
+
+    uint32_t presenceVersion;
+
+    uint64_t respondWrite;
+    uint64_t respondRead;
+    BrokerRespond responds[BROKER_RESPOND_SLOTS];
+
+    uint64_t eventWrite;
+    DiscordRich_StoredRecord events[BROKER_EVENT_SLOTS];
+
+    // Replayed to clients that attach after the connection is ready
+    bool isReady;
+    DiscordRich_StoredRecord readyEvent;
+};
+
+static struct {
+    BrokerShared * shared;
+    int fd; // Kept open with a shared flock() while attached
+    int slot;
+    int role;
+    char name[96];
+    uint32_t presenceVersion;
+    uint64_t eventRead;
+    uint64_t lastLivenessCheck;
+    bool pendingReady;
+    DiscordRich_PresenceFields presence;
+    DiscordRich_StoredRecord event;
+} broker;
+
+static void lock()
+{
+    if (pthread_mutex_lock(&broker.shared->mutex) == EOWNERDEAD) {
+        pthread_mutex_consistent(&broker.shared->mutex);
+    }
+}
+
+static void unlock()
+{
+    pthread_mutex_unlock(&broker.shared->mutex);
+}
+
+static bool isAlive(int32_t pid)
+{
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+// Must be called with the lock held. Drops the patch of a process
+static void clearProcess(BrokerProcess * process)
+{
+    if (process->presence.mask) {
+        process->presence.mask = 0;
+        broker.shared->presenceVersion += 1;
+    }
+    process->pid = 0;
+}
+
+// Must be called with the lock held. Returns the number of live processes
+// attached, other than this one
+static int pruneProcesses()
+{
+    BrokerShared * shared = broker.shared;
+    int32_t pid = getpid();
+    int others = 0;
+    for (int i = 0; i < BROKER_PROCESS_SLOTS; i++) {
+        BrokerProcess * process = &shared->processes[i];
+        if (!process->pid || process->pid == pid) { continue; }
+        if (isAlive(process->pid)) {
+            others += 1;
+        } else {
+            clearProcess(process);
+        }
+    }
+    return others;
+}
+
+// Must be called with the lock held
+static bool claimIfOrphaned()
+{
+    BrokerShared * shared = broker.shared;
+    if (shared->ownerPid && shared->ownerPid != getpid() && isAlive(shared->ownerPid)) { return false; }
+
+    shared->ownerPid = getpid();
+    shared->ownerEpoch += 1;
+    broker.role = DISCORDRICH_BROKER_OWNER;
+
+    // Send whatever presence was published before, if any
+    broker.presenceVersion = shared->presenceVersion ? shared->presenceVersion - 1 : 0;
+    return true;
+}
+
+static void copyString(char * dest, size_t destSize, const char * src)
+{
+    strncpy(dest, src, destSize - 1);
+    dest[destSize - 1] = 0;
+}
+
+// Opens and maps the segment, creating it if needed. Returns NULL if it isn't
+// usable. *stale is then set if the segment was never initialized (its
+// creator crashed) or comes from another version, and no live process holds it
+static BrokerShared * mapSegment(int * fdOut, bool * stale)
+{
+    *stale = false;
+
+    int fd = shm_open(broker.name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    bool created = fd >= 0;
+    if (!created) {
+        if (errno == EEXIST) { fd = shm_open(broker.name, O_RDWR, 0600); }
+        if (fd < 0) {
+            dmLogWarning("Could not open the presence broker \"%s\": %s", broker.name, strerror(errno));
+            return NULL;
+        }
+    }
+
+    // Every attached process holds a shared lock. The kernel releases it when
+    // a process dies, so an exclusive lock only succeeds on an unused segment
+    flock(fd, LOCK_SH);
+
+    uint64_t deadline = dmTime::GetTime() + BROKER_OPEN_TIMEOUT;
+    if (created) {
+        if (ftruncate(fd, sizeof(BrokerShared)) != 0) {
+            dmLogWarning("Could not size the presence broker: %s", strerror(errno));
+            close(fd);
+            shm_unlink(broker.name);
+            return NULL;
+        }
+    } else {
+        // The creator might not have sized it yet
+        struct stat st;
+        while (fstat(fd, &st) == 0 && st.st_size < (off_t)sizeof(BrokerShared)) {
+            if (dmTime::GetTime() >= deadline) { break; }
+            dmTime::Sleep(1000);
+        }
+        if (st.st_size < (off_t)sizeof(BrokerShared)) {
+            *stale = flock(fd, LOCK_EX | LOCK_NB) == 0;
+            close(fd);
+            return NULL;
+        }
+    }
+
+    void * mem = mmap(NULL, sizeof(BrokerShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        dmLogWarning("Could not map the presence broker: %s", strerror(errno));
+        close(fd);
+        if (created) { shm_unlink(broker.name); }
+        return NULL;
+    }
+    BrokerShared * shared = (BrokerShared *)mem;
+
+    if (created) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&shared->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        shared->version = BROKER_VERSION;
+        __atomic_store_n(&shared->magic, BROKER_MAGIC, __ATOMIC_RELEASE);
+    } else {
+        while (__atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) != BROKER_MAGIC && dmTime::GetTime() < deadline) {
+            dmTime::Sleep(1000);
+        }
+        if (__atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) != BROKER_MAGIC || shared->version != BROKER_VERSION) {
+            *stale = flock(fd, LOCK_EX | LOCK_NB) == 0;
+            munmap(mem, sizeof(BrokerShared));
+            close(fd);
+            return NULL;
+        }
+    }
+
+    *fdOut = fd;
+    return shared;
+}
+
+int DiscordRich_brokerOpen(const char * applicationId)
+{
+    if (broker.shared) { return broker.role; }
+
+    int len = snprintf(broker.name, sizeof(broker.name), "/discordrich-%s", applicationId);
+    for (int i = 1; i < len; i++) {
+        char c = broker.name[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-')) {
+            broker.name[i] = '_';
+        }
+    }
+
+    int fd = -1;
+    bool stale;
+    BrokerShared * shared = mapSegment(&fd, &stale);
+    if (!shared && stale) {
+        dmLogInfo("Replacing the unused presence broker \"%s\"", broker.name);
+        shm_unlink(broker.name);
+        shared = mapSegment(&fd, &stale);
+    }
+    if (!shared) {
+        dmLogWarning("The presence broker \"%s\" is not usable", broker.name);
+        return DISCORDRICH_BROKER_NONE;
+    }
+
+    broker.shared = shared;
+    broker.fd = fd;
+    broker.role = DISCORDRICH_BROKER_CLIENT;
+
+    lock();
+    pruneProcesses();
+    int slot = -1;
+    for (int i = 0; i < BROKER_PROCESS_SLOTS && slot < 0; i++) {
+        if (!shared->processes[i].pid) { slot = i; }
+    }
+    if (slot < 0) {
+        unlock();
+        dmLogWarning("Too many processes attached to the presence broker \"%s\"", broker.name);
+        munmap(shared, sizeof(BrokerShared));
+        close(fd);
+        broker.shared = NULL;
+        broker.role = DISCORDRICH_BROKER_NONE;
+        return DISCORDRICH_BROKER_NONE;
+    }
+    broker.slot = slot;
+    shared->processes[slot].pid = getpid();
+    shared->processes[slot].presence.mask = 0;
+    claimIfOrphaned();
+    broker.eventRead = shared->eventWrite;
+    broker.pendingReady = broker.role == DISCORDRICH_BROKER_CLIENT && shared->isReady;
+    if (broker.pendingReady) {
+        memcpy(&broker.event, &shared->readyEvent, sizeof(broker.event));
+    }
+    unlock();
+
+    broker.lastLivenessCheck = dmTime::GetTime();
+    dmLogInfo("Presence broker \"%s\" opened as %s", broker.name, broker.role == DISCORDRICH_BROKER_OWNER ? "owner" : "client");
+    return broker.role;
+}
+
+void DiscordRich_brokerClose()
+{
+    if (!broker.shared) { return; }
+
+    lock();
+    if (broker.shared->ownerPid == getpid()) {
+        // Hand over. The next client to poll takes the connection
+        broker.shared->ownerPid = 0;
+        broker.shared->ownerEpoch += 1;
+        broker.shared->isReady = false;
+    }
+    clearProcess(&broker.shared->processes[broker.slot]);
+    bool last = pruneProcesses() == 0;
+    unlock();
+
+    munmap(broker.shared, sizeof(BrokerShared));
+    if (last) { shm_unlink(broker.name); }
+    close(broker.fd);
+
+    broker.shared = NULL;
+    broker.role = DISCORDRICH_BROKER_NONE;
+    broker.pendingReady = false;
+}
+
+int DiscordRich_brokerRole()
+{
+    return broker.role;
+}
+
+bool DiscordRich_brokerPoll()
+{
+    if (broker.role != DISCORDRICH_BROKER_CLIENT) { return false; }
+
+    // A clean hand over is seen right away. A dead owner only every so often
+    int32_t ownerPid = __atomic_load_n(&broker.shared->ownerPid, __ATOMIC_ACQUIRE);
+    uint64_t now = dmTime::GetTime();
+    if (ownerPid && now - broker.lastLivenessCheck < BROKER_LIVENESS_INTERVAL) { return false; }
+    broker.lastLivenessCheck = now;
+
+    lock();
+    bool claimed = claimIfOrphaned();
+    if (claimed) {
+        broker.shared->isReady = false;
+        // Drop the patch of a crashed owner
+        pruneProcesses();
+    }
+    unlock();
+
+    if (claimed) {
+        dmLogInfo("Took over the Discord connection from the presence broker \"%s\"", broker.name);
+    }
+    return claimed;
+}
+
+void DiscordRich_brokerPublishPresence(const DiscordRichPresence * presence)
+{
+    if (!broker.shared) { return; }
+
+    lock();
+    BrokerProcess * process = &broker.shared->processes[broker.slot];
+    if (presence) {
+        DiscordRich_presenceToFields(presence, &process->presence);
+    } else {
+        process->presence.mask = 0;
+    }
+    broker.shared->presenceVersion += 1;
+    process->presenceOrder = broker.shared->presenceVersion;
+    unlock();
+}
+
+bool DiscordRich_brokerTakePresence(DiscordRichPresence * presence, bool * clear)
+{
+    if (broker.role != DISCORDRICH_BROKER_OWNER) { return false; }
+
+    uint32_t version = __atomic_load_n(&broker.shared->presenceVersion, __ATOMIC_ACQUIRE);
+    if (version == broker.presenceVersion) { return false; }
+
+    lock();
+    broker.presenceVersion = broker.shared->presenceVersion;
+    DiscordRich_clearFields(&broker.presence);
+    for (int field = 0; field < DISCORDRICH_FIELD_COUNT; field++) {
+        const BrokerProcess * latest = NULL;
+        for (int i = 0; i < BROKER_PROCESS_SLOTS; i++) {
+            const BrokerProcess * process = &broker.shared->processes[i];
+            if (!process->pid || !(process->presence.mask & (1u << field))) { continue; }
+            if (!latest || (int32_t)(process->presenceOrder - latest->presenceOrder) > 0) { latest = process; }
+        }
+        if (latest) { DiscordRich_copyField(&broker.presence, &latest->presence, field); }
+    }
+    unlock();
+
+    *clear = !broker.presence.mask;
+    DiscordRich_fieldsToPresence(&broker.presence, presence);
+    return true;
+}
+
+void DiscordRich_brokerPublishRespond(const char * userId, int reply)
+{
+    if (!broker.shared) { return; }
+
+    lock();
+    BrokerShared * shared = broker.shared;
+    if (shared->respondWrite - shared->respondRead < BROKER_RESPOND_SLOTS) {
+        BrokerRespond * respond = &shared->responds[shared->respondWrite % BROKER_RESPOND_SLOTS];
+        copyString(respond->userId, sizeof(respond->userId), userId);
+        respond->reply = reply;
+        shared->respondWrite += 1;
+    } else {
+        dmLogWarning("Too many pending responses in the presence broker. Dropping one");
+    }
+    unlock();
+}
+
+bool DiscordRich_brokerTakeRespond(char * userId, size_t userIdSize, int * reply)
+{
+    if (broker.role != DISCORDRICH_BROKER_OWNER) { return false; }
+
+    BrokerShared * shared = broker.shared;
+    if (__atomic_load_n(&shared->respondWrite, __ATOMIC_ACQUIRE) == __atomic_load_n(&shared->respondRead, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    lock();
+    bool found = shared->respondRead != shared->respondWrite;
+    if (found) {
+        BrokerRespond * respond = &shared->responds[shared->respondRead % BROKER_RESPOND_SLOTS];
+        copyString(userId, userIdSize, respond->userId);
+        *reply = respond->reply;
+        shared->respondRead += 1;
+    }
+    unlock();
+    return found;
+}
+
+void DiscordRich_brokerPublishEvent(const DiscordRich_Record * record)
+{
+    if (broker.role != DISCORDRICH_BROKER_OWNER) { return; }
+
+    lock();
+    BrokerShared * shared = broker.shared;
+    DiscordRich_StoredRecord * event = &shared->events[shared->eventWrite % BROKER_EVENT_SLOTS];
+    DiscordRich_storeRecord(event, record);
+
+    if (record->type == DISCORDRICH_RECORD_READY) {
+        memcpy(&shared->readyEvent, event, sizeof(shared->readyEvent));
+        shared->isReady = true;
+    } else if (record->type == DISCORDRICH_RECORD_DISCONNECTED) {
+        shared->isReady = false;
+    }
+
+    __atomic_store_n(&shared->eventWrite, shared->eventWrite + 1, __ATOMIC_RELEASE);
+    unlock();
+}
+
+bool DiscordRich_brokerNextEvent(DiscordRich_Record * record)
+{
+    if (broker.role != DISCORDRICH_BROKER_CLIENT) { return false; }
+
+    if (broker.pendingReady) {
+        broker.pendingReady = false;
+        DiscordRich_loadRecord(&broker.event, record);
+        return true;
+    }
+
+    if (__atomic_load_n(&broker.shared->eventWrite, __ATOMIC_ACQUIRE) == broker.eventRead) { return false; }
+
+    lock();
+    uint64_t write = broker.shared->eventWrite;
+    if (write - broker.eventRead > BROKER_EVENT_SLOTS) {
+        dmLogWarning("Missed %d events from the presence broker", (int)(write - broker.eventRead - BROKER_EVENT_SLOTS));
+        broker.eventRead = write - BROKER_EVENT_SLOTS;
+    }
+    memcpy(&broker.event, &broker.shared->events[broker.eventRead % BROKER_EVENT_SLOTS], sizeof(broker.event));
+    unlock();
+    broker.eventRead += 1;
+
+    DiscordRich_loadRecord(&broker.event, record);
+    return true;
+}
+
+#else
+
+int DiscordRich_brokerOpen(const char * applicationId)
+{
+    dmLogWarning("The presence broker is only available on Linux");
+    return DISCORDRICH_BROKER_NONE;
+}
+
+void DiscordRich_brokerClose() {}
+int DiscordRich_brokerRole() { return DISCORDRICH_BROKER_NONE; }
+bool DiscordRich_brokerPoll() { return false; }
+void DiscordRich_brokerPublishPresence(const DiscordRichPresence * presence) {}
+void DiscordRich_brokerPublishRespond(const char * userId, int reply) {}
+bool DiscordRich_brokerTakePresence(DiscordRichPresence * presence, bool * clear) { return false; }
+bool DiscordRich_brokerTakeRespond(char * userId, size_t userIdSize, int * reply) { return false; }
+void DiscordRich_brokerPublishEvent(const DiscordRich_Record * record) {}
+bool DiscordRich_brokerNextEvent(DiscordRich_Record * record) { return false; }
+
+#endif
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef _BROKER_H_
+#define _BROKER_H_
+
+#include "common.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+#include "capture.h"
+
+// Presence broker for games made of several processes (eg. a launcher and the
+// game it starts) that all use this extension. The processes share a memory
+// segment per application id. The first one to open it owns the Discord
+// connection. The others (clients) publish their presence and responses to
+// it and receive its events. When the owner exits (or dies), a client takes
+// over. Only available on Linux.
+
+enum DiscordRich_BrokerRole {
+    DISCORDRICH_BROKER_NONE = 0,
+    DISCORDRICH_BROKER_OWNER = 1,
+    DISCORDRICH_BROKER_CLIENT = 2,
+};
+
+// Returns the role of this process, or DISCORDRICH_BROKER_NONE if the broker is unavailable
+int DiscordRich_brokerOpen(const char * applicationId);
+void DiscordRich_brokerClose();
+int DiscordRich_brokerRole();
+
+// Clients: returns true if this process just took over the connection
+bool DiscordRich_brokerPoll();
+
+// Any role. Publishes the fields this process sets, replacing its previous
+// patch. The owner merges the patches of all the processes: for each field,
+// the most recently published value wins. NULL withdraws this process' fields
+void DiscordRich_brokerPublishPresence(const DiscordRichPresence * presence);
+void DiscordRich_brokerPublishRespond(const char * userId, int reply);
+
+// Owner: returns true if the merged presence changed since it was last taken.
+// *clear is set if no process sets any field. The presence stays valid until the next call
+bool DiscordRich_brokerTakePresence(DiscordRichPresence * presence, bool * clear);
+bool DiscordRich_brokerTakeRespond(char * userId, size_t userIdSize, int * reply);
+void DiscordRich_brokerPublishEvent(const DiscordRich_Record * record);
+
+// Clients: attaching to a ready connection starts with its ready event.
+// The strings in the record stay valid until the next call
+bool DiscordRich_brokerNextEvent(DiscordRich_Record * record);
+
+#endif
+#endif
@@ -0,0 +1,431 @@
+#include "capture.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+#define CAPTURE_MAGIC "DRCP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 8
+
+static uint64_t getMonotonicTime()
+{
+    #if defined(_WIN32)
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000
+        + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+    #elif defined(__APPLE__)
+    static mach_timebase_info_data_t timebase = { 0, 0 };
+    if (!timebase.denom) { mach_timebase_info(&timebase); }
+    return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+    #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    #endif
+}
+
+// Writing
+
+static struct {
+    FILE * file;
+    uint64_t startTime;
+    uint64_t lastTimestamp;
+} capture;
+
+// Grows to fit the largest record so far and is reused for the next ones
+struct WriteBuffer {
+    uint8_t * data;
+    size_t size;
+    size_t capacity;
+};
+
+static WriteBuffer writeBuffer;
+
+static void reserveBytes(WriteBuffer * buf, size_t count)
+{
+    if (buf->size + count <= buf->capacity) { return; }
+
+    size_t capacity = buf->capacity ? buf->capacity : 2048;
+    while (capacity < buf->size + count) { capacity *= 2; }
+
+    uint8_t * data = new uint8_t[capacity];
+    if (buf->size) { memcpy(data, buf->data, buf->size); }
+    delete[] buf->data;
+    buf->data = data;
+    buf->capacity = capacity;
+}
+
+static void writeVarint(WriteBuffer * buf, uint64_t value)
+{
+    reserveBytes(buf, 10);
+    for (;;) {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            buf->data[buf->size++] = byte | 0x80;
+        } else {
+            buf->data[buf->size++] = byte;
+            return;
+        }
+    }
+}
+
+static void writeSigned(WriteBuffer * buf, int64_t value)
+{
+    writeVarint(buf, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+static void writeString(WriteBuffer * buf, const char * str)
+{
+    if (!str) {
+        writeVarint(buf, 0);
+        return;
+    }
+    size_t len = strlen(str);
+    writeVarint(buf, len + 1);
+    reserveBytes(buf, len);
+    memcpy(buf->data + buf->size, str, len);
+    buf->size += len;
+}
+
+static void writeUser(WriteBuffer * buf, const DiscordUser * user)
+{
+    writeString(buf, user->userId);
+    writeString(buf, user->username);
+    writeString(buf, user->discriminator);
+    writeString(buf, user->avatar);
+}
+
+static void writePresence(WriteBuffer * buf, const DiscordRichPresence * presence)
+{
+    writeString(buf, presence->state);
+    writeString(buf, presence->details);
+    writeSigned(buf, presence->startTimestamp);
+    writeSigned(buf, presence->endTimestamp);
+    writeString(buf, presence->largeImageKey);
+    writeString(buf, presence->largeImageText);
+    writeString(buf, presence->smallImageKey);
+    writeString(buf, presence->smallImageText);
+    writeString(buf, presence->partyId);
+    writeSigned(buf, presence->partySize);
+    writeSigned(buf, presence->partyMax);
+    writeString(buf, presence->matchSecret);
+    writeString(buf, presence->joinSecret);
+    writeString(buf, presence->spectateSecret);
+    writeSigned(buf, presence->instance);
+}
+
+enum StoredRecordFlags {
+    STORED_HAS_TEXT = 1 << 0,
+    STORED_HAS_USER_ID = 1 << 1,
+    STORED_HAS_USERNAME = 1 << 2,
+    STORED_HAS_DISCRIMINATOR = 1 << 3,
+    STORED_HAS_AVATAR = 1 << 4,
+};
+
+void DiscordRich_storeRecord(DiscordRich_StoredRecord * stored, const DiscordRich_Record * record)
+{
+    stored->type = record->type;
+    stored->code = record->code;
+    stored->flags = 0;
+
+#define store_string(flag, src, dest) \
+    if (src) { \
+        stored->flags |= flag; \
+        strncpy(stored->dest, src, sizeof(stored->dest) - 1); \
+        stored->dest[sizeof(stored->dest) - 1] = 0; \
+    }
+
+    store_string(STORED_HAS_TEXT, record->text, text);
+    store_string(STORED_HAS_USER_ID, record->user.userId, userId);
+    store_string(STORED_HAS_USERNAME, record->user.username, username);
+    store_string(STORED_HAS_DISCRIMINATOR, record->user.discriminator, discriminator);
+    store_string(STORED_HAS_AVATAR, record->user.avatar, avatar);
+
+#undef store_string
+}
+
+void DiscordRich_loadRecord(const DiscordRich_StoredRecord * stored, DiscordRich_Record * record)
+{
+    memset(record, 0, sizeof(*record));
+    record->type = stored->type;
+    record->code = stored->code;
+    if (stored->flags & STORED_HAS_TEXT) { record->text = stored->text; }
+    if (stored->flags & STORED_HAS_USER_ID) { record->user.userId = stored->userId; }
+    if (stored->flags & STORED_HAS_USERNAME) { record->user.username = stored->username; }
+    if (stored->flags & STORED_HAS_DISCRIMINATOR) { record->user.discriminator = stored->discriminator; }
+    if (stored->flags & STORED_HAS_AVATAR) { record->user.avatar = stored->avatar; }
+}
+
+bool DiscordRich_startCapture(const char * path)
+{
+    DiscordRich_stopCapture();
+
+    capture.file = fopen(path, "wb");
+    if (!capture.file) {
+        dmLogError("Could not open capture file \"%s\"", path);
+        return false;
+    }
+
+    uint8_t header[CAPTURE_HEADER_SIZE] = { 0 };
+    memcpy(header, CAPTURE_MAGIC, 4);
+    header[4] = CAPTURE_VERSION;
+    fwrite(header, 1, sizeof(header), capture.file);
+
+    capture.startTime = getMonotonicTime();
+    capture.lastTimestamp = 0;
+    return true;
+}
+
+void DiscordRich_stopCapture()
+{
+    if (!capture.file) { return; }
+    fclose(capture.file);
+    capture.file = NULL;
+
+    delete[] writeBuffer.data;
+    writeBuffer.data = NULL;
+    writeBuffer.capacity = 0;
+}
+
+void DiscordRich_captureRecord(const DiscordRich_Record * record)
+{
+    if (!capture.file) { return; }
+
+    uint64_t timestamp = getMonotonicTime() - capture.startTime;
+
+    WriteBuffer & buf = writeBuffer;
+    buf.size = 0;
+    reserveBytes(&buf, 1);
+    buf.data[buf.size++] = (uint8_t)record->type;
+    writeVarint(&buf, timestamp - capture.lastTimestamp);
+    capture.lastTimestamp = timestamp;
+
+    switch (record->type) {
+        case DISCORDRICH_RECORD_PRESENCE:
+            writePresence(&buf, &record->presence);
+            break;
+        case DISCORDRICH_RECORD_RESPOND:
+            writeString(&buf, record->text);
+            writeSigned(&buf, record->code);
+            break;
+        case DISCORDRICH_RECORD_READY:
+        case DISCORDRICH_RECORD_JOIN_REQUEST:
+            writeUser(&buf, &record->user);
+            break;
+        case DISCORDRICH_RECORD_DISCONNECTED:
+        case DISCORDRICH_RECORD_ERRORED:
+            writeSigned(&buf, record->code);
+            writeString(&buf, record->text);
+            break;
+        case DISCORDRICH_RECORD_JOIN_GAME:
+        case DISCORDRICH_RECORD_SPECTATE_GAME:
+            writeString(&buf, record->text);
+            break;
+        default:
+            break;
+    }
+
+    fwrite(buf.data, 1, buf.size, capture.file);
+}
+
+// Reading
+
+static struct {
+    uint8_t * data;
+    size_t size;
+    size_t offset;
+    double speed;
+    uint64_t startTime;
+    uint64_t timestamp;
+    char strings[4096];
+    size_t stringsSize;
+} replay;
+
+static uint64_t readVarint()
+{
+    uint64_t value = 0;
+    int shift = 0;
+    while (replay.offset < replay.size && shift < 64) {
+        uint8_t byte = replay.data[replay.offset++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) { break; }
+        shift += 7;
+    }
+    return value;
+}
+
+static int64_t readSigned()
+{
+    uint64_t value = readVarint();
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static const char * readString()
+{
+    uint64_t len = readVarint();
+    if (!len) { return NULL; }
+    len -= 1;
+
+    if (len > replay.size - replay.offset) { len = replay.size - replay.offset; }
+    if (len + 1 > sizeof(replay.strings) - replay.stringsSize) {
+        replay.offset += len;
+        return "";
+    }
+
+    char * str = replay.strings + replay.stringsSize;
+    memcpy(str, replay.data + replay.offset, len);
+    str[len] = 0;
+    replay.offset += len;
+    replay.stringsSize += len + 1;
+    return str;
+}
+
+static void readUser(DiscordUser * user)
+{
+    user->userId = readString();
+    user->username = readString();
+    user->discriminator = readString();
+    user->avatar = readString();
+}
+
+static void readPresence(DiscordRichPresence * presence)
+{
+    presence->state = readString();
+    presence->details = readString();
+    presence->startTimestamp = readSigned();
+    presence->endTimestamp = readSigned();
+    presence->largeImageKey = readString();
+    presence->largeImageText = readString();
+    presence->smallImageKey = readString();
+    presence->smallImageText = readString();
+    presence->partyId = readString();
+    presence->partySize = (int)readSigned();
+    presence->partyMax = (int)readSigned();
+    presence->matchSecret = readString();
+    presence->joinSecret = readString();
+    presence->spectateSecret = readString();
+    presence->instance = (int8_t)readSigned();
+}
+
+bool DiscordRich_startReplay(const char * path, double speed)
+{
+    DiscordRich_stopReplay();
+
+    FILE * f = fopen(path, "rb");
+    if (!f) {
+        dmLogError("Could not open capture file \"%s\"", path);
+        return false;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if (size < CAPTURE_HEADER_SIZE) {
+        dmLogError("\"%s\" is not a capture file", path);
+        fclose(f);
+        return false;
+    }
+
+    replay.data = new uint8_t[size];
+    replay.size = fread(replay.data, 1, size, f);
+    fclose(f);
+
+    if (replay.size < CAPTURE_HEADER_SIZE || memcmp(replay.data, CAPTURE_MAGIC, 4) || replay.data[4] != CAPTURE_VERSION) {
+        dmLogError("\"%s\" is not a capture file or has an unsupported version", path);
+        DiscordRich_stopReplay();
+        return false;
+    }
+
+    replay.offset = CAPTURE_HEADER_SIZE;
+    replay.speed = speed;
+    replay.startTime = getMonotonicTime();
+    replay.timestamp = 0;
+    return true;
+}
+
+void DiscordRich_stopReplay()
+{
+    if (replay.data) { delete[] replay.data; }
+    replay.data = NULL;
+    replay.size = 0;
+    replay.offset = 0;
+}
+
+bool DiscordRich_isReplaying()
+{
+    return replay.data != NULL;
+}
+
+bool DiscordRich_nextReplayRecord(DiscordRich_Record * record)
+{
+    if (!replay.data) { return false; }
+    if (replay.offset >= replay.size) {
+        DiscordRich_stopReplay();
+        return false;
+    }
+
+    size_t recordOffset = replay.offset;
+    int type = replay.data[replay.offset++];
+    uint64_t timestamp = replay.timestamp + readVarint();
+
+    if (replay.speed > 0) {
+        double elapsed = (double)(getMonotonicTime() - replay.startTime) * replay.speed;
+        if ((double)timestamp > elapsed) {
+            replay.offset = recordOffset;
+            return false;
+        }
+    }
+    replay.timestamp = timestamp;
+
+    memset(record, 0, sizeof(*record));
+    record->type = type;
+    record->timestamp = timestamp;
+    replay.stringsSize = 0;
+
+    switch (type) {
+        case DISCORDRICH_RECORD_PRESENCE:
+            readPresence(&record->presence);
+            break;
+        case DISCORDRICH_RECORD_CLEAR_PRESENCE:
+            break;
+        case DISCORDRICH_RECORD_RESPOND:
+            record->text = readString();
+            record->code = (int)readSigned();
+            break;
+        case DISCORDRICH_RECORD_READY:
+        case DISCORDRICH_RECORD_JOIN_REQUEST:
+            readUser(&record->user);
+            break;
+        case DISCORDRICH_RECORD_DISCONNECTED:
+        case DISCORDRICH_RECORD_ERRORED:
+            record->code = (int)readSigned();
+            record->text = readString();
+            break;
+        case DISCORDRICH_RECORD_JOIN_GAME:
+        case DISCORDRICH_RECORD_SPECTATE_GAME:
+            record->text = readString();
+            break;
+        default:
+            dmLogError("Unknown record type %d in capture file. Stopping replay", type);
+            DiscordRich_stopReplay();
+            return false;
+    }
+
+    return true;
+}
+
+#endif
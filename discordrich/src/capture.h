@@ -0,0 +1,65 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include "common.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+// Capture files are a 8 byte header ("DRCP" + version) followed by records.
+// Every record is a type byte and the time since the previous record in
+// microseconds (varint), followed by the payload of that type. Strings are
+// stored as varint (length + 1), with 0 meaning NULL.
+
+enum DiscordRich_RecordType {
+    DISCORDRICH_RECORD_PRESENCE = 1,
+    DISCORDRICH_RECORD_CLEAR_PRESENCE = 2,
+    DISCORDRICH_RECORD_RESPOND = 3,
+    DISCORDRICH_RECORD_READY = 4,
+    DISCORDRICH_RECORD_DISCONNECTED = 5,
+    DISCORDRICH_RECORD_ERRORED = 6,
+    DISCORDRICH_RECORD_JOIN_GAME = 7,
+    DISCORDRICH_RECORD_SPECTATE_GAME = 8,
+    DISCORDRICH_RECORD_JOIN_REQUEST = 9,
+};
+
+struct DiscordRich_Record {
+    int type;
+    uint64_t timestamp;   // Microseconds since the start of the capture
+    int code;             // errcode for DISCONNECTED/ERRORED, reply for RESPOND
+    const char * text;    // Message, secret or user id depending on type
+    DiscordUser user;
+    DiscordRichPresence presence;
+};
+
+// An event record with its own copy of the strings (truncated to fit), for
+// queues that outlive the handler call. The presence is not kept
+struct DiscordRich_StoredRecord {
+    int type;
+    int code;
+    uint32_t flags;
+    char text[256];
+    char userId[32];
+    char username[128];
+    char discriminator[8];
+    char avatar[64];
+};
+
+void DiscordRich_storeRecord(DiscordRich_StoredRecord * stored, const DiscordRich_Record * record);
+// The strings in the record point into stored
+void DiscordRich_loadRecord(const DiscordRich_StoredRecord * stored, DiscordRich_Record * record);
+
+bool DiscordRich_startCapture(const char * path);
+void DiscordRich_stopCapture();
+void DiscordRich_captureRecord(const DiscordRich_Record * record);
+
+// speed is a multiplier of the original timing. 0 replays everything at once
+bool DiscordRich_startReplay(const char * path, double speed);
+void DiscordRich_stopReplay();
+bool DiscordRich_isReplaying();
+
+// Fetches the next record that is due. Strings in the record stay valid
+// until the next call
+bool DiscordRich_nextReplayRecord(DiscordRich_Record * record);
+
+#endif
+#endif
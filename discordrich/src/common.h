@@ -19,6 +19,9 @@
 #include "discord_rpc.h"
 #include "discord_register.h"
 
+bool DiscordRich_getExecutablePath(char * buffer, size_t bufferSize);
+bool DiscordRich_getDataPath(char * buffer, size_t bufferSize, const char * fileName);
+
 #ifdef DISCORD_RPC_STATIC
 
 #define sym_Discord_Initialize Discord_Initialize
@@ -31,8 +34,8 @@
 #define sym_Discord_Register Discord_Register
 #define sym_Discord_RegisterSteamGame Discord_RegisterSteamGame
 
-#define DiscordRich_openLibrary() do {} while (0)
-#define DiscordRich_closeLibrary() do {} while (0)
+#define DiscordRich_openLibrary(appConfig) do {} while (0)
+#define DiscordRich_closeLibrary(unload) do {} while (0)
 
 #else
 
@@ -60,7 +63,8 @@ extern void (*sym_Discord_RegisterSteamGame)(const char* applicationId, const ch
 #endif
 
 void DiscordRich_openLibrary(dmConfigFile::HConfig appConfig);
-void DiscordRich_closeLibrary();
+// unload is false when it's not safe to unload the library (a thread might still be running its code)
+void DiscordRich_closeLibrary(bool unload);
 
 #endif
 
@@ -0,0 +1,137 @@
+#include "errors.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+#include <string.h>
+
+static struct {
+    DiscordRich_ErrorEntry entries[DISCORDRICH_ERROR_SLOTS];
+    uint32_t next;
+    uint64_t interval;
+    uint64_t lastSummary;
+    uint32_t logLimit;
+    uint32_t logged;      // Immediate logs since windowStart
+    uint64_t windowStart;
+    uint32_t suppressed;  // Occurrences dropped from the ring without being logged
+} errors = { {}, 0, 10 * 1000000, 0, DISCORDRICH_ERROR_LOG_LIMIT, 0, 0, 0 };
+
+void DiscordRich_setErrorSummaryInterval(uint64_t interval)
+{
+    errors.interval = interval;
+}
+
+void DiscordRich_setErrorLogLimit(uint32_t limit)
+{
+    errors.logLimit = limit;
+}
+
+// Errors whose message changes every time (eg. it contains a counter or a
+// timestamp) aren't deduplicated, so the immediate logs are capped as a whole
+static bool takeLogSlot(uint64_t now)
+{
+    if (now - errors.windowStart >= errors.interval) {
+        errors.windowStart = now;
+        errors.logged = 0;
+    }
+    if (errors.logged >= errors.logLimit) { return false; }
+    errors.logged += 1;
+    return true;
+}
+
+static void logPending(const DiscordRich_ErrorEntry * entry)
+{
+    if (entry->pending == entry->count) {
+        dmLogError("Error running event handler (%u times): %s", entry->count, entry->message);
+    } else {
+        dmLogError("Error running event handler (repeated %u more times, %u total): %s", entry->pending, entry->count, entry->message);
+    }
+}
+
+static void copyTruncated(char * dest, size_t destSize, const char * src, size_t len)
+{
+    if (len > destSize - 1) { len = destSize - 1; }
+    memcpy(dest, src, len);
+    dest[len] = 0;
+}
+
+void DiscordRich_reportError(const char * message, size_t messageLen, const char * traceback)
+{
+    dmhash_t hash = dmHashBuffer64(message, (uint32_t)messageLen);
+    uint64_t now = dmTime::GetTime();
+
+    for (uint32_t i = 0; i < DISCORDRICH_ERROR_SLOTS; i++) {
+        DiscordRich_ErrorEntry * entry = &errors.entries[i];
+        if (entry->count && entry->hash == hash) {
+            entry->count += 1;
+            entry->pending += 1;
+            entry->lastTime = now;
+            return;
+        }
+    }
+
+    DiscordRich_ErrorEntry * entry = &errors.entries[errors.next];
+    errors.next = (errors.next + 1) % DISCORDRICH_ERROR_SLOTS;
+
+    if (entry->pending) {
+        if (takeLogSlot(now)) {
+            logPending(entry);
+        } else {
+            errors.suppressed += entry->pending;
+        }
+    }
+
+    entry->hash = hash;
+    entry->count = 1;
+    entry->pending = 0;
+    entry->firstTime = now;
+    entry->lastTime = now;
+    copyTruncated(entry->message, sizeof(entry->message), message, messageLen);
+    if (traceback) {
+        copyTruncated(entry->traceback, sizeof(entry->traceback), traceback, strlen(traceback));
+    } else {
+        entry->traceback[0] = 0;
+    }
+
+    if (!takeLogSlot(now)) {
+        // Left for the summary, or counted as suppressed if it leaves the ring first
+        entry->pending = 1;
+    } else if (traceback) {
+        dmLogError("Error running event handler: %s", traceback);
+    } else {
+        dmLogError("Error running event handler: %s", entry->message);
+    }
+}
+
+void DiscordRich_flushErrors(bool force)
+{
+    uint64_t now = dmTime::GetTime();
+    if (!force && now - errors.lastSummary < errors.interval) { return; }
+    errors.lastSummary = now;
+
+    for (uint32_t i = 0; i < DISCORDRICH_ERROR_SLOTS; i++) {
+        DiscordRich_ErrorEntry * entry = &errors.entries[i];
+        if (!entry->pending) { continue; }
+        logPending(entry);
+        entry->pending = 0;
+    }
+
+    if (errors.suppressed) {
+        dmLogError("%u more errors from event handlers were not logged (more than %u per interval)", errors.suppressed, errors.logLimit);
+        errors.suppressed = 0;
+    }
+}
+
+const DiscordRich_ErrorEntry * DiscordRich_getErrors(uint32_t * start)
+{
+    *start = errors.next;
+    return errors.entries;
+}
+
+void DiscordRich_clearErrors()
+{
+    memset(errors.entries, 0, sizeof(errors.entries));
+    errors.next = 0;
+    errors.suppressed = 0;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef _ERRORS_H_
+#define _ERRORS_H_
+
+#include "common.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+#define DISCORDRICH_ERROR_SLOTS 16
+#define DISCORDRICH_ERROR_MESSAGE_MAX 256
+#define DISCORDRICH_ERROR_TRACEBACK_MAX 1024
+#define DISCORDRICH_ERROR_LOG_LIMIT 10
+
+// Errors from event handlers are aggregated by message. The first occurrence
+// of a message is logged right away, repeats are only counted and logged as
+// a periodic summary. The most recent distinct messages are kept in a ring.
+// At most DISCORDRICH_ERROR_LOG_LIMIT messages are logged right away per
+// interval, the others wait for the summary.
+struct DiscordRich_ErrorEntry {
+    dmhash_t hash;
+    uint32_t count;   // Total occurrences
+    uint32_t pending; // Occurrences not logged yet
+    uint64_t firstTime;
+    uint64_t lastTime;
+    char message[DISCORDRICH_ERROR_MESSAGE_MAX];
+    char traceback[DISCORDRICH_ERROR_TRACEBACK_MAX];
+};
+
+void DiscordRich_setErrorSummaryInterval(uint64_t interval);
+void DiscordRich_setErrorLogLimit(uint32_t limit);
+
+// traceback can be NULL
+void DiscordRich_reportError(const char * message, size_t messageLen, const char * traceback);
+
+// Logs the summary if the interval has elapsed (or right away if force is set)
+void DiscordRich_flushErrors(bool force);
+
+// Entries in the order they were first seen. Empty slots have a count of 0
+const DiscordRich_ErrorEntry * DiscordRich_getErrors(uint32_t * start);
+void DiscordRich_clearErrors();
+
+#endif
+#endif
@@ -1,4 +1,14 @@
 #include "common.h"
+#include "register.h"
+#include "capture.h"
+#include "avatar.h"
+#include "errors.h"
+#include "shutdown.h"
+#include "presence.h"
+#include "template.h"
+#include "backend.h"
+#include "broker.h"
+#include "party.h"
 
 #ifdef DISCORD_RPC_SUPPORTED
 
@@ -18,9 +28,26 @@ static bool checkWin7() {
 static bool isWin7 = checkWin7();
 #endif
 
-static bool discordInitialized = false;
+enum DiscordState {
+    STATE_UNLOADED = 0,     // The Discord RPC library is not available
+    STATE_LOADED = 1,       // The library is loaded, but initialize() was not called
+    STATE_CONNECTING = 2,   // Waiting for the handshake with the Discord client
+    STATE_READY = 3,        // Connected. The ready handler was called
+    STATE_DISCONNECTED = 4, // Lost the connection. The library keeps trying to reconnect
+    STATE_SHUTTING_DOWN = 5, // Also while an abandoned shutdown is still running
+};
+
+static DiscordState discordState = STATE_UNLOADED;
+static uint64_t shutdownTimeout = 1000000;
+static char discordApplicationId[64] = "";
+static bool brokerEnabled = false;
+// Set while an abandoned shutdown still holds the connection. See closeBrokerWhenIdle()
+static bool brokerClosePending = false;
 
-static int shutdown(lua_State *L);
+static bool isSessionActive()
+{
+    return discordState == STATE_CONNECTING || discordState == STATE_READY || discordState == STATE_DISCONNECTED;
+}
 
 struct LuaCallbackInfo {
     LuaCallbackInfo() : m_L(0), m_Callback(LUA_NOREF), m_Self(LUA_NOREF) {}
@@ -38,6 +65,17 @@ static struct {
     LuaCallbackInfo joinRequest;
 } callbacks;
 
+struct RegisterCallbackInfo {
+    uint32_t m_JobId;
+    LuaCallbackInfo m_Callback;
+};
+
+static dmArray<RegisterCallbackInfo> registerCallbacks;
+
+// debug.traceback, used as the message handler of event handlers when
+// discordrich.error_traceback is enabled
+static int tracebackHandler = LUA_NOREF;
+
 static void clearCallback(LuaCallbackInfo * cbk)
 {
     if (cbk->m_Callback != LUA_NOREF) {
@@ -74,6 +112,12 @@ static void callCallback(LuaCallbackInfo * cbk, int nargs)
     lua_State * L = cbk->m_L;
     int top = lua_gettop(L);
 
+    int handlerIndex = 0;
+    if (tracebackHandler != LUA_NOREF) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, tracebackHandler);
+        handlerIndex = lua_gettop(L);
+    }
+
     lua_rawgeti(L, LUA_REGISTRYINDEX, cbk->m_Callback);
 
     // Setup self (the script instance)
@@ -81,14 +125,28 @@ static void callCallback(LuaCallbackInfo * cbk, int nargs)
     dmScript::SetInstance(L);
 
     for (int i = 0; i < nargs; i++) {
-        lua_pushvalue(L, -nargs - 1);
+        lua_pushvalue(L, -nargs - 1 - (handlerIndex ? 1 : 0));
     }
 
-    int ret = lua_pcall(L, nargs, 0, 0);
+    int ret = lua_pcall(L, nargs, 0, handlerIndex);
     if (ret != 0) {
-        dmLogError("Error running event handler: %s", lua_tostring(L, -1));
+        size_t len = 0;
+        const char * error = lua_tolstring(L, -1, &len);
+        if (!error) { error = "(error object is not a string)"; len = strlen(error); }
+
+        // The traceback starts with the message. Aggregate on the message alone
+        const char * traceback = NULL;
+        if (handlerIndex) {
+            const char * stack = strstr(error, "\nstack traceback:");
+            if (stack) {
+                traceback = error;
+                len = stack - error;
+            }
+        }
+        DiscordRich_reportError(error, len, traceback);
         lua_pop(L, 1);
     }
+    if (handlerIndex) { lua_pop(L, 1); }
     assert(top == lua_gettop(L));
 
     lua_pop(L, nargs);
@@ -115,8 +173,87 @@ static void pushDiscordUser(lua_State * L, const DiscordUser * user)
     }
 }
 
+static void makeRecord(DiscordRich_Record * record, int type, int code, const char * text, const DiscordUser * user)
+{
+    memset(record, 0, sizeof(*record));
+    record->type = type;
+    record->code = code;
+    record->text = text;
+    if (user) { record->user = *user; }
+}
+
+static void captureEvent(int type, int code, const char * text, const DiscordUser * user)
+{
+    DiscordRich_Record record;
+    makeRecord(&record, type, code, text, user);
+    DiscordRich_captureRecord(&record);
+}
+
+#define MAX_BUFFERED_EVENTS 16
+
+// Replayed events go to the handlers, but don't change the state of the live
+// connection, aren't captured again, buffered or published to the broker clients
+static bool dispatchingReplay = false;
+
+// Events of a session started from game.project, kept until Lua attaches handlers
+static struct {
+    bool awaitingHandlers;
+    bool dispatching;
+    bool dropping; // The overflow warning was already logged
+    uint32_t count;
+    DiscordRich_StoredRecord events[MAX_BUFFERED_EVENTS];
+} bufferedEvents;
+
+// Buffered events already went through this when they arrived, and replayed
+// events don't belong to the live connection
+static bool isLiveEvent()
+{
+    return !dispatchingReplay && !bufferedEvents.dispatching;
+}
+
+// Captures an incoming event and hands it to the broker clients. Returns true
+// if the event was buffered instead of being passed to the Lua handler
+static bool forwardEvent(int type, int code, const char * text, const DiscordUser * user)
+{
+    // Already captured and forwarded when it was buffered, or read from a capture
+    if (!isLiveEvent()) { return false; }
+
+    DiscordRich_Record record;
+    makeRecord(&record, type, code, text, user);
+    DiscordRich_captureRecord(&record);
+    DiscordRich_brokerPublishEvent(&record);
+
+    if (!bufferedEvents.awaitingHandlers) { return false; }
+
+    if (bufferedEvents.count == MAX_BUFFERED_EVENTS) {
+        if (!bufferedEvents.dropping) {
+            dmLogWarning("No handlers attached yet. Dropping the oldest buffered events");
+            bufferedEvents.dropping = true;
+        }
+        memmove(&bufferedEvents.events[0], &bufferedEvents.events[1], sizeof(bufferedEvents.events[0]) * (MAX_BUFFERED_EVENTS - 1));
+        bufferedEvents.count -= 1;
+    }
+    DiscordRich_storeRecord(&bufferedEvents.events[bufferedEvents.count++], &record);
+    return true;
+}
+
+static void pushSecretLobby(lua_State * L, const char * secret)
+{
+    const char * lobby = secret ? DiscordRich_getSecretLobby(secret) : NULL;
+    if (lobby) {
+        lua_pushstring(L, lobby);
+    } else {
+        lua_pushnil(L);
+    }
+}
+
 static void handleDiscordReady(const DiscordUser * user)
 {
+    bool buffered = forwardEvent(DISCORDRICH_RECORD_READY, 0, NULL, user);
+
+    if (isLiveEvent()) { discordState = STATE_READY; }
+    if (buffered) { return; }
+
     LuaCallbackInfo * cbk = &callbacks.ready;
     if (cbk->m_Callback == LUA_NOREF) { return; }
     lua_State * L = cbk->m_L;
@@ -127,6 +264,11 @@ static void handleDiscordReady(const DiscordUser * user)
 
 static void handleDiscordDisconnected(int errcode, const char * message)
 {
+    bool buffered = forwardEvent(DISCORDRICH_RECORD_DISCONNECTED, errcode, message, NULL);
+
+    if (isLiveEvent() && discordState == STATE_READY) { discordState = STATE_DISCONNECTED; }
+    if (buffered) { return; }
+
     LuaCallbackInfo * cbk = &callbacks.disconnected;
     if (cbk->m_Callback == LUA_NOREF) { return; }
     lua_State * L = cbk->m_L;
@@ -138,6 +280,8 @@ static void handleDiscordDisconnected(int errcode, const char * message)
 
 static void handleDiscordErrored(int errcode, const char * message)
 {
+    if (forwardEvent(DISCORDRICH_RECORD_ERRORED, errcode, message, NULL)) { return; }
+
     LuaCallbackInfo * cbk = &callbacks.errored;
     if (cbk->m_Callback == LUA_NOREF) { return; }
     lua_State * L = cbk->m_L;
@@ -149,27 +293,35 @@ static void handleDiscordErrored(int errcode, const char * message)
 
 static void handleDiscordJoinGame(const char * joinSecret)
 {
+    if (forwardEvent(DISCORDRICH_RECORD_JOIN_GAME, 0, joinSecret, NULL)) { return; }
+
     LuaCallbackInfo * cbk = &callbacks.joinGame;
     if (cbk->m_Callback == LUA_NOREF) { return; }
     lua_State * L = cbk->m_L;
 
     lua_pushstring(L, joinSecret);
-    callCallback(cbk, 1);
+    pushSecretLobby(L, joinSecret);
+    callCallback(cbk, 2);
 }
 
 static void handleDiscordSpectateGame(const char* spectateSecret)
 {
+    if (forwardEvent(DISCORDRICH_RECORD_SPECTATE_GAME, 0, spectateSecret, NULL)) { return; }
+
     LuaCallbackInfo * cbk = &callbacks.spectateGame;
     if (cbk->m_Callback == LUA_NOREF) { return; }
     lua_State * L = cbk->m_L;
 
     lua_pushstring(L, spectateSecret);
-    callCallback(cbk, 1);
+    pushSecretLobby(L, spectateSecret);
+    callCallback(cbk, 2);
 }
 
 static void handleDiscordJoinRequest(const DiscordUser* request)
 {
-    LuaCallbackInfo * cbk = &callbacks.ready;
+    if (forwardEvent(DISCORDRICH_RECORD_JOIN_REQUEST, 0, NULL, request)) { return; }
+
+    LuaCallbackInfo * cbk = &callbacks.joinRequest;
     if (cbk->m_Callback == LUA_NOREF) { return; }
     lua_State * L = cbk->m_L;
 
@@ -177,7 +329,7 @@ static void handleDiscordJoinRequest(const DiscordUser* request)
     callCallback(cbk, 1);
 }
 
-static void saveHandlers(lua_State * L, int index, DiscordEventHandlers * handlers)
+static void fillHandlers(DiscordEventHandlers * handlers)
 {
     handlers->ready = handleDiscordReady;
     handlers->errored = handleDiscordErrored;
@@ -185,6 +337,11 @@ static void saveHandlers(lua_State * L, int index, DiscordEventHandlers * handle
     handlers->joinGame = handleDiscordJoinGame;
     handlers->spectateGame = handleDiscordSpectateGame;
     handlers->joinRequest = handleDiscordJoinRequest;
+}
+
+static void saveHandlers(lua_State * L, int index, DiscordEventHandlers * handlers)
+{
+    fillHandlers(handlers);
 
     if (lua_gettop(L) < index) { return; }
     if (lua_isnil(L, index)) { return; }
@@ -213,31 +370,115 @@ static void freeHandlers()
     clearCallback(&callbacks.joinRequest);
 }
 
+static void watchRegister(lua_State * L, int index, uint32_t jobId)
+{
+    if (!jobId || lua_isnoneornil(L, index)) { return; }
+
+    if (registerCallbacks.Full()) {
+        registerCallbacks.OffsetCapacity(4);
+    }
+    RegisterCallbackInfo info;
+    info.m_JobId = jobId;
+    setCallback(L, index, &info.m_Callback);
+    registerCallbacks.Push(info);
+}
+
+static void dispatchRegisterCallbacks()
+{
+    uint32_t jobId;
+    int status;
+    while (DiscordRich_pollRegister(&jobId, &status)) {
+        for (uint32_t i = 0; i < registerCallbacks.Size(); i++) {
+            RegisterCallbackInfo * info = &registerCallbacks[i];
+            if (info->m_JobId != jobId) { continue; }
+
+            LuaCallbackInfo cbk = info->m_Callback;
+            registerCallbacks.EraseSwap(i);
+
+            lua_pushnumber(cbk.m_L, status);
+            callCallback(&cbk, 1);
+            clearCallback(&cbk);
+            break;
+        }
+    }
+}
+
+static void freeRegisterCallbacks()
+{
+    for (uint32_t i = 0; i < registerCallbacks.Size(); i++) {
+        clearCallback(&registerCallbacks[i].m_Callback);
+    }
+    registerCallbacks.SetSize(0);
+}
+
 static int register_(lua_State *L)
 {
-    if (!sym_Discord_Register) { return 0; }
     const char * applicationId = luaL_checkstring(L, 1);
     const char * command = luaL_checkstring(L, 2);
-    sym_Discord_Register(applicationId, command);
+    uint32_t jobId = DiscordRich_queueRegister(applicationId, command, NULL);
+    watchRegister(L, 3, jobId);
     return 0;
 }
 
 static int register_steam_game(lua_State *L)
 {
-    if (!sym_Discord_RegisterSteamGame) { return 0; }
     const char * applicationId = luaL_checkstring(L, 1);
     const char * steamId = luaL_checkstring(L, 2);
-    sym_Discord_RegisterSteamGame(applicationId, steamId);
+    uint32_t jobId = DiscordRich_queueRegister(applicationId, NULL, steamId);
+    watchRegister(L, 3, jobId);
     return 0;
 }
 
-static int shutdown(lua_State *L)
+static int get_register_status(lua_State *L)
 {
-    if (!discordInitialized) { return 0; }
-    if (!sym_Discord_Shutdown) { return 0; }
-    sym_Discord_Shutdown();
+    const char * applicationId = luaL_checkstring(L, 1);
+    lua_pushnumber(L, DiscordRich_getRegisterStatus(applicationId));
+    return 1;
+}
+
+// An owner hands the connection over when it closes the broker. That has to
+// wait until its own connection is gone, or a client would connect while the
+// old connection is still open
+static void closeBrokerWhenIdle()
+{
+    if (!brokerClosePending || DiscordRich_isShutdownPending()) { return; }
+    DiscordRich_brokerClose();
+    brokerClosePending = false;
+}
+
+static bool shutdownSession(uint64_t deadline)
+{
+    if (!isSessionActive()) { return true; }
+    if (!DiscordRich_backend->shutdown) { return true; }
+
+    discordState = STATE_SHUTTING_DOWN;
+
+    // A broker client never opened the connection
+    bool ownsConnection = DiscordRich_brokerRole() != DISCORDRICH_BROKER_CLIENT;
+    bool completed = ownsConnection ? DiscordRich_shutdownLibrary(deadline) : true;
+    brokerClosePending = true;
+    closeBrokerWhenIdle();
+
     freeHandlers();
-    return 0;
+    bufferedEvents.awaitingHandlers = false;
+    bufferedEvents.dropping = false;
+    bufferedEvents.count = 0;
+
+    discordApplicationId[0] = 0;
+    // An abandoned shutdown stays in STATE_SHUTTING_DOWN until the helper
+    // thread finishes (see UpdateExtension)
+    if (completed) { discordState = STATE_LOADED; }
+    return completed;
+}
+
+static int shutdown(lua_State *L)
+{
+    uint64_t timeout = shutdownTimeout;
+    if (!lua_isnoneornil(L, 1)) {
+        timeout = (uint64_t)(luaL_checknumber(L, 1) * 1000000.0);
+    }
+    lua_pushboolean(L, shutdownSession(dmTime::GetTime() + timeout));
+    return 1;
 }
 
 static bool check_boolean(lua_State *L, int index) {
@@ -250,15 +491,109 @@ static bool check_boolean(lua_State *L, int index) {
     return luaL_error(L, "expected boolean value");
 }
 
+// Calls the handler of an event record. Returns false for other records
+static bool dispatchEventRecord(const DiscordRich_Record * record)
+{
+    switch (record->type) {
+        case DISCORDRICH_RECORD_READY:
+            handleDiscordReady(&record->user);
+            return true;
+        case DISCORDRICH_RECORD_DISCONNECTED:
+            handleDiscordDisconnected(record->code, record->text);
+            return true;
+        case DISCORDRICH_RECORD_ERRORED:
+            handleDiscordErrored(record->code, record->text);
+            return true;
+        case DISCORDRICH_RECORD_JOIN_GAME:
+            handleDiscordJoinGame(record->text);
+            return true;
+        case DISCORDRICH_RECORD_SPECTATE_GAME:
+            handleDiscordSpectateGame(record->text);
+            return true;
+        case DISCORDRICH_RECORD_JOIN_REQUEST:
+            handleDiscordJoinRequest(&record->user);
+            return true;
+    }
+    return false;
+}
+
+static void startSession(const char * applicationId, DiscordEventHandlers * handlers, bool autoRegister, const char * optionalSteamId)
+{
+    // Registration can spawn processes (xdg-mime on Linux), so keep it off the main thread
+    if (autoRegister) {
+        DiscordRich_queueRegister(applicationId, NULL, optionalSteamId);
+    }
+
+    strncpy(discordApplicationId, applicationId, sizeof(discordApplicationId) - 1);
+    discordApplicationId[sizeof(discordApplicationId) - 1] = 0;
+    discordState = STATE_CONNECTING;
+
+    // Another process of the game owns the connection. Its events come through the broker
+    closeBrokerWhenIdle();
+    if (brokerEnabled && DiscordRich_brokerOpen(applicationId) == DISCORDRICH_BROKER_CLIENT) {
+        DiscordRich_resendPresence();
+        return;
+    }
+
+    DiscordRich_backend->initialize(applicationId, handlers, 0, optionalSteamId);
+    DiscordRich_resendPresence();
+}
+
+// Lua handlers were attached. Events buffered until now are passed to them on the next update
+static void attachHandlers()
+{
+    bufferedEvents.awaitingHandlers = false;
+    bufferedEvents.dropping = false;
+}
+
+static void dispatchBufferedEvents()
+{
+    if (bufferedEvents.awaitingHandlers || !bufferedEvents.count) { return; }
+
+    bufferedEvents.dispatching = true;
+    for (uint32_t i = 0; i < bufferedEvents.count; i++) {
+        DiscordRich_Record record;
+        DiscordRich_loadRecord(&bufferedEvents.events[i], &record);
+        dispatchEventRecord(&record);
+    }
+    bufferedEvents.count = 0;
+    bufferedEvents.dispatching = false;
+}
+
 static int initialize(lua_State *L)
 {
-    if (discordInitialized) { shutdown(L); }
-    if (!sym_Discord_Initialize) { return 0; }
+    if (!DiscordRich_backend->initialize) { return 0; }
+    if (DiscordRich_isShutdownPending()) {
+        dmLogError("Can't initialize while the previous session is still shutting down");
+        return 0;
+    }
 
     int argc = lua_gettop(L);
 
     const char * applicationId = luaL_checkstring(L, 1);
 
+    if (isSessionActive()) {
+        if (!strcmp(applicationId, discordApplicationId)) {
+            // Same application (possibly started from game.project). Keep the
+            // connection and only swap the handlers
+            if (argc >= 2 && !lua_isnil(L, 2) && DiscordRich_backend->updateHandlers) {
+                freeHandlers();
+                DiscordEventHandlers handlers;
+                saveHandlers(L, 2, &handlers);
+                if (DiscordRich_brokerRole() != DISCORDRICH_BROKER_CLIENT) {
+                    DiscordRich_backend->updateHandlers(&handlers);
+                }
+            }
+            // Even without handlers. Lua took over the session, so stop buffering
+            attachHandlers();
+            return 0;
+        }
+        if (!shutdownSession(dmTime::GetTime() + shutdownTimeout)) {
+            dmLogError("Can't initialize while the previous session is still shutting down");
+            return 0;
+        }
+    }
+
     DiscordEventHandlers handlers;
     saveHandlers(L, 2, &handlers);
 
@@ -272,13 +607,38 @@ static int initialize(lua_State *L)
         optionalSteamId = luaL_checkstring(L, 4);
     }
 
-    sym_Discord_Initialize(applicationId, &handlers, autoRegister, optionalSteamId);
+    startSession(applicationId, &handlers, autoRegister, optionalSteamId);
     return 0;
 }
 
+static void sendPresence(const DiscordRichPresence * presence)
+{
+    DiscordRich_Record record;
+    makeRecord(&record, DISCORDRICH_RECORD_PRESENCE, 0, NULL, NULL);
+    record.presence = *presence;
+    DiscordRich_captureRecord(&record);
+
+    // With the broker, the owner sends the shared presence on its next update
+    if (DiscordRich_brokerRole() != DISCORDRICH_BROKER_NONE) {
+        DiscordRich_brokerPublishPresence(presence);
+    } else if (!DiscordRich_isShutdownPending()) {
+        DiscordRich_backend->updatePresence(presence);
+    }
+}
+
+static void sendClearPresence()
+{
+    captureEvent(DISCORDRICH_RECORD_CLEAR_PRESENCE, 0, NULL, NULL);
+    if (DiscordRich_brokerRole() != DISCORDRICH_BROKER_NONE) {
+        DiscordRich_brokerPublishPresence(NULL);
+    } else if (!DiscordRich_isShutdownPending()) {
+        DiscordRich_backend->clearPresence();
+    }
+}
+
 static int update_presence(lua_State *L)
 {
-    if (!sym_Discord_UpdatePresence) { return 0; }
+    if (!DiscordRich_backend->updatePresence) { return 0; }
 
     DiscordRichPresence presence;
     memset(&presence, 0, sizeof(presence));
@@ -315,36 +675,760 @@ static int update_presence(lua_State *L)
     set_string_field("spectate_secret", spectateSecret);
     set_number_field("instance", instance);
 
-    sym_Discord_UpdatePresence(&presence);
+    sendPresence(&presence);
+    DiscordRich_invalidatePresence();
     return 0;
 }
 
 static int clear_presence(lua_State *L)
 {
-    if (!sym_Discord_ClearPresence) { return 0; }
-    sym_Discord_ClearPresence();
+    if (!DiscordRich_backend->clearPresence) { return 0; }
+    sendClearPresence();
+    DiscordRich_invalidatePresence();
     return 0;
 }
 
+static void readPresenceFields(lua_State * L, int index, DiscordRich_PresenceFields * fields)
+{
+    luaL_checktype(L, index, LUA_TTABLE);
+    DiscordRich_clearFields(fields);
+
+    for (int field = 0; field < DISCORDRICH_FIELD_COUNT; field++) {
+        const DiscordRich_FieldInfo * info = DiscordRich_getFieldInfo(field);
+        lua_getfield(L, index, info->name);
+        if (!lua_isnil(L, -1)) {
+            if (info->isString) {
+                size_t len;
+                const char * value = luaL_checklstring(L, -1, &len);
+                DiscordRich_setStringField(fields, field, value, len);
+            } else {
+                DiscordRich_setNumberField(fields, field, (int64_t)luaL_checknumber(L, -1));
+            }
+        }
+        lua_pop(L, 1);
+    }
+}
+
+static int set_layer(lua_State *L)
+{
+    const char * name = luaL_checkstring(L, 1);
+    int priority = (int)luaL_checknumber(L, 2);
+
+    static DiscordRich_PresenceFields fields;
+    readPresenceFields(L, 3, &fields);
+    DiscordRich_setPresenceLayer(name, priority, &fields);
+    return 0;
+}
+
+static int clear_layer(lua_State *L)
+{
+    const char * name = luaL_checkstring(L, 1);
+    lua_pushboolean(L, DiscordRich_clearPresenceLayer(name));
+    return 1;
+}
+
+static int compile_template(lua_State *L)
+{
+    const char * format = luaL_checkstring(L, 1);
+    char error[128];
+    uint32_t id = DiscordRich_compileTemplate(format, error, sizeof(error));
+    if (!id) {
+        return luaL_error(L, "invalid template: %s", error);
+    }
+    lua_pushnumber(L, id);
+    return 1;
+}
+
+// Reads the template id at index and the values after it
+static uint32_t checkTemplateValues(lua_State * L, int index, DiscordRich_TemplateValue * values, int * valueCount)
+{
+    uint32_t id = (uint32_t)luaL_checknumber(L, index);
+    int count = DiscordRich_getTemplateValueCount(id);
+    luaL_argcheck(L, count >= 0, index, "unknown template");
+
+    int argc = lua_gettop(L);
+    for (int i = 0; i < count; i++) {
+        int arg = index + 1 + i;
+        DiscordRich_TemplateValue * value = &values[i];
+        if (arg > argc || lua_isnil(L, arg)) {
+            // Missing values render as empty
+            value->isString = true;
+            value->string = "";
+            value->length = 0;
+        } else if (lua_type(L, arg) == LUA_TSTRING) {
+            value->isString = true;
+            value->string = lua_tolstring(L, arg, &value->length);
+        } else {
+            value->isString = false;
+            value->number = luaL_checknumber(L, arg);
+        }
+    }
+    *valueCount = count;
+    return id;
+}
+
+static int render_template(lua_State *L)
+{
+    DiscordRich_TemplateValue values[DISCORDRICH_TEMPLATE_MAX_VALUES];
+    int valueCount;
+    uint32_t id = checkTemplateValues(L, 1, values, &valueCount);
+
+    char buffer[DISCORDRICH_FIELD_MAX + 1];
+    size_t len = DiscordRich_renderTemplate(id, values, valueCount, buffer, sizeof(buffer));
+    lua_pushlstring(L, buffer, len);
+    return 1;
+}
+
+static int set_layer_text(lua_State *L)
+{
+    const char * name = luaL_checkstring(L, 1);
+    int field = DiscordRich_findField(luaL_checkstring(L, 2));
+    const DiscordRich_FieldInfo * info = DiscordRich_getFieldInfo(field);
+    luaL_argcheck(L, info && info->isString, 2, "not a string presence field");
+
+    DiscordRich_TemplateValue values[DISCORDRICH_TEMPLATE_MAX_VALUES];
+    int valueCount;
+    uint32_t id = checkTemplateValues(L, 3, values, &valueCount);
+
+    char * buffer = DiscordRich_editPresenceLayerField(name, field);
+    if (!buffer) {
+        return luaL_error(L, "presence layer \"%s\" does not exist", name);
+    }
+    DiscordRich_renderTemplate(id, values, valueCount, buffer, info->maxLength + 1);
+    return 0;
+}
+
+static int set_number_format(lua_State *L)
+{
+    const char * groupSeparator = luaL_checkstring(L, 1);
+    const char * decimalSeparator = luaL_optstring(L, 2, NULL);
+    DiscordRich_setNumberFormat(groupSeparator, decimalSeparator);
+    return 0;
+}
+
+static void flushPresenceLayers()
+{
+    // Keep the layers dirty until the library can be called again
+    if (DiscordRich_isShutdownPending()) { return; }
+
+    DiscordRichPresence presence;
+    bool clear;
+    if (!DiscordRich_composePresence(&presence, &clear)) { return; }
+
+    if (clear) {
+        if (DiscordRich_backend->clearPresence) { sendClearPresence(); }
+    } else {
+        if (DiscordRich_backend->updatePresence) { sendPresence(&presence); }
+    }
+}
+
 static int respond(lua_State *L)
 {
-    if (!sym_Discord_Respond) { return 0; }
+    if (!DiscordRich_backend->respond) { return 0; }
     const char * userId = luaL_checkstring(L, 1);
     int reply = luaL_checknumber(L, 2);
-    sym_Discord_Respond(userId, reply);
+    captureEvent(DISCORDRICH_RECORD_RESPOND, reply, userId, NULL);
+    if (DiscordRich_brokerRole() == DISCORDRICH_BROKER_CLIENT) {
+        DiscordRich_brokerPublishRespond(userId, reply);
+    } else if (!DiscordRich_isShutdownPending()) {
+        DiscordRich_backend->respond(userId, reply);
+    }
     return 0;
 }
 
+static void dispatchBroker()
+{
+    int role = DiscordRich_brokerRole();
+    if (role == DISCORDRICH_BROKER_NONE || brokerClosePending) { return; }
+
+    if (DiscordRich_brokerPoll()) {
+        // The owner went away. Open our own connection
+        role = DISCORDRICH_BROKER_OWNER;
+        discordState = STATE_CONNECTING;
+        DiscordEventHandlers handlers;
+        fillHandlers(&handlers);
+        DiscordRich_backend->initialize(discordApplicationId, &handlers, 0, NULL);
+    }
+
+    if (role == DISCORDRICH_BROKER_CLIENT) {
+        DiscordRich_Record record;
+        while (DiscordRich_brokerNextEvent(&record)) {
+            dispatchEventRecord(&record);
+        }
+        return;
+    }
+
+    DiscordRichPresence presence;
+    bool clear;
+    if (DiscordRich_brokerTakePresence(&presence, &clear)) {
+        if (clear) {
+            if (DiscordRich_backend->clearPresence) { DiscordRich_backend->clearPresence(); }
+        } else {
+            if (DiscordRich_backend->updatePresence) { DiscordRich_backend->updatePresence(&presence); }
+        }
+    }
+
+    char userId[32];
+    int reply;
+    while (DiscordRich_brokerTakeRespond(userId, sizeof(userId), &reply)) {
+        if (DiscordRich_backend->respond) { DiscordRich_backend->respond(userId, reply); }
+    }
+}
+
+static int get_broker_role(lua_State *L)
+{
+    lua_pushnumber(L, DiscordRich_brokerRole());
+    return 1;
+}
+
+static bool replaySendsPresence = false;
+
+static void dispatchReplay()
+{
+    bool send = replaySendsPresence && !DiscordRich_isShutdownPending();
+    DiscordRich_Record record;
+    while (DiscordRich_nextReplayRecord(&record)) {
+        dispatchingReplay = true;
+        bool handled = dispatchEventRecord(&record);
+        dispatchingReplay = false;
+        if (handled || !send) { continue; }
+
+        switch (record.type) {
+            case DISCORDRICH_RECORD_PRESENCE:
+                if (DiscordRich_backend->updatePresence) {
+                    DiscordRich_backend->updatePresence(&record.presence);
+                }
+                break;
+            case DISCORDRICH_RECORD_CLEAR_PRESENCE:
+                if (DiscordRich_backend->clearPresence) {
+                    DiscordRich_backend->clearPresence();
+                }
+                break;
+            case DISCORDRICH_RECORD_RESPOND:
+                if (DiscordRich_backend->respond) {
+                    DiscordRich_backend->respond(record.text, record.code);
+                }
+                break;
+        }
+    }
+}
+
+static int start_capture(lua_State *L)
+{
+    const char * path = luaL_checkstring(L, 1);
+    lua_pushboolean(L, DiscordRich_startCapture(path));
+    return 1;
+}
+
+static int stop_capture(lua_State *L)
+{
+    DiscordRich_stopCapture();
+    return 0;
+}
+
+static int replay(lua_State *L)
+{
+    const char * path = luaL_checkstring(L, 1);
+    double speed = luaL_optnumber(L, 2, 1.0);
+    replaySendsPresence = !lua_isnoneornil(L, 3) && check_boolean(L, 3);
+    lua_pushboolean(L, DiscordRich_startReplay(path, speed));
+    return 1;
+}
+
+static int stop_replay(lua_State *L)
+{
+    DiscordRich_stopReplay();
+    return 0;
+}
+
+static int is_replaying(lua_State *L)
+{
+    lua_pushboolean(L, DiscordRich_isReplaying());
+    return 1;
+}
+
+enum AvatarRequestState {
+    AVATAR_MEMORY,
+    AVATAR_DISK,
+    AVATAR_HTTP,
+    AVATAR_DECODE,
+};
+
+struct AvatarRequest {
+    uint32_t m_Id;
+    uint32_t m_JobId;
+    AvatarRequestState m_State;
+    uint64_t m_Deadline; // For AVATAR_HTTP
+    dmhash_t m_Key;
+    char m_Name[DISCORDRICH_AVATAR_KEY_MAX];
+    char m_Url[512];
+    LuaCallbackInfo m_Callback;
+};
+
+struct AvatarImage {
+    dmhash_t m_Key;
+    int m_Ref;
+    uint32_t m_Size;
+    uint64_t m_LastUse;
+};
+
+#define DEFAULT_AVATAR_MEMORY_LIMIT (4 * 1024 * 1024)
+
+// http.request() never calls back if the script that issued it was deleted,
+// so requests are also dropped on our side a bit after the HTTP timeout
+#define AVATAR_HTTP_TIMEOUT 30
+#define AVATAR_HTTP_GRACE 5000000
+
+static dmArray<AvatarRequest> avatarRequests;
+static dmArray<AvatarImage> avatarImages;
+static uint32_t avatarNextRequestId = 0;
+static uint64_t avatarUseCounter = 0;
+static uint32_t avatarImagesSize = 0;
+static uint32_t avatarMemoryLimit = DEFAULT_AVATAR_MEMORY_LIMIT;
+
+static AvatarImage * findAvatarImage(dmhash_t key)
+{
+    for (uint32_t i = 0; i < avatarImages.Size(); i++) {
+        if (avatarImages[i].m_Key == key) {
+            avatarImages[i].m_LastUse = ++avatarUseCounter;
+            return &avatarImages[i];
+        }
+    }
+    return NULL;
+}
+
+static void removeAvatarImage(lua_State * L, uint32_t index)
+{
+    dmScript::Unref(L, LUA_REGISTRYINDEX, avatarImages[index].m_Ref);
+    avatarImagesSize -= avatarImages[index].m_Size;
+    avatarImages.EraseSwap(index);
+}
+
+// Pushes an image table like the ones image.load() returns
+static void pushAvatarImage(lua_State * L, const DiscordRich_AvatarResult * result)
+{
+    lua_newtable(L);
+    lua_pushnumber(L, result->width);
+    lua_setfield(L, -2, "width");
+    lua_pushnumber(L, result->height);
+    lua_setfield(L, -2, "height");
+
+    lua_getglobal(L, "image");
+    if (lua_istable(L, -1)) {
+        lua_getfield(L, -1, "TYPE_RGBA");
+        lua_remove(L, -2);
+    } else {
+        lua_pop(L, 1);
+        lua_pushstring(L, "rgba");
+    }
+    lua_setfield(L, -2, "type");
+
+    lua_pushlstring(L, (const char *)result->pixels, (size_t)result->width * result->height * 4);
+    lua_setfield(L, -2, "buffer");
+}
+
+// Expects the image table on the top of the stack
+static void addAvatarImage(lua_State * L, dmhash_t key, uint32_t size)
+{
+    if (size > avatarMemoryLimit) { return; }
+
+    while (avatarImagesSize + size > avatarMemoryLimit && avatarImages.Size()) {
+        uint32_t oldest = 0;
+        for (uint32_t i = 1; i < avatarImages.Size(); i++) {
+            if (avatarImages[i].m_LastUse < avatarImages[oldest].m_LastUse) { oldest = i; }
+        }
+        removeAvatarImage(L, oldest);
+    }
+
+    if (avatarImages.Full()) {
+        avatarImages.OffsetCapacity(16);
+    }
+    AvatarImage image;
+    image.m_Key = key;
+    lua_pushvalue(L, -1);
+    image.m_Ref = dmScript::Ref(L, LUA_REGISTRYINDEX);
+    image.m_Size = size;
+    image.m_LastUse = ++avatarUseCounter;
+    avatarImages.Push(image);
+    avatarImagesSize += size;
+}
+
+static bool isCallbackInstanceValid(LuaCallbackInfo * cbk)
+{
+    lua_State * L = cbk->m_L;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cbk->m_Self);
+    dmScript::SetInstance(L);
+    return dmScript::IsInstanceValid(L);
+}
+
+// Expects the callback arguments on the top of the stack. Skips the call if
+// the script that asked for the avatar was deleted in the meantime
+static void deliverAvatar(AvatarRequest * request, int nargs)
+{
+    if (isCallbackInstanceValid(&request->m_Callback)) {
+        callCallback(&request->m_Callback, nargs);
+    } else {
+        lua_pop(request->m_Callback.m_L, nargs);
+    }
+    clearCallback(&request->m_Callback);
+}
+
+static void deliverAvatarError(AvatarRequest * request, const char * message)
+{
+    lua_State * L = request->m_Callback.m_L;
+    lua_pushnil(L);
+    lua_pushstring(L, message);
+    deliverAvatar(request, 2);
+}
+
+static void deliverAvatarImage(AvatarRequest * request, int ref)
+{
+    lua_State * L = request->m_Callback.m_L;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    deliverAvatar(request, 1);
+}
+
+static int findAvatarRequest(uint32_t id, AvatarRequestState state)
+{
+    for (uint32_t i = 0; i < avatarRequests.Size(); i++) {
+        AvatarRequest * request = &avatarRequests[i];
+        if (request->m_State != state) { continue; }
+        if ((state == AVATAR_HTTP ? request->m_Id : request->m_JobId) == id) { return (int)i; }
+    }
+    return -1;
+}
+
+static int avatarHttpCallback(lua_State * L)
+{
+    uint32_t id = (uint32_t)lua_tonumber(L, lua_upvalueindex(1));
+    int index = findAvatarRequest(id, AVATAR_HTTP);
+    if (index < 0) { return 0; }
+
+    lua_getfield(L, 3, "status");
+    int status = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 3, "response");
+    size_t size = 0;
+    const char * data = lua_isstring(L, -1) ? lua_tolstring(L, -1, &size) : NULL;
+
+    if (status == 200 && data && size) {
+        // Decoded (and written to the disk cache) on the avatar worker
+        AvatarRequest * request = &avatarRequests[index];
+        request->m_State = AVATAR_DECODE;
+        request->m_JobId = DiscordRich_storeAvatar(request->m_Name, data, size);
+    } else {
+        AvatarRequest request = avatarRequests[index];
+        avatarRequests.EraseSwap(index);
+
+        char message[64];
+        snprintf(message, sizeof(message), "HTTP request failed with status %d", status);
+        deliverAvatarError(&request, message);
+    }
+
+    lua_pop(L, 1);
+    return 0;
+}
+
+// Called as requestAvatar(url, id) under lua_pcall, so a missing http module
+// fails the request instead of raising an error out of the update
+static int requestAvatar(lua_State * L)
+{
+    lua_getglobal(L, "http");
+    lua_getfield(L, -1, "request");
+    lua_pushvalue(L, 1);
+    lua_pushstring(L, "GET");
+    lua_pushvalue(L, 2);
+    lua_pushcclosure(L, avatarHttpCallback, 1);
+    lua_pushnil(L);
+    lua_pushnil(L);
+    lua_newtable(L);
+    lua_pushnumber(L, AVATAR_HTTP_TIMEOUT);
+    lua_setfield(L, -2, "timeout");
+    lua_call(L, 6, 0);
+    return 0;
+}
+
+static void fetchAvatar(AvatarRequest * request)
+{
+    lua_State * L = request->m_Callback.m_L;
+    int top = lua_gettop(L);
+
+    // http.request() replies to the script instance that issued it
+    lua_rawgeti(L, LUA_REGISTRYINDEX, request->m_Callback.m_Self);
+    dmScript::SetInstance(L);
+
+    request->m_State = AVATAR_HTTP;
+    request->m_Deadline = dmTime::GetTime() + AVATAR_HTTP_TIMEOUT * 1000000ULL + AVATAR_HTTP_GRACE;
+
+    lua_pushcfunction(L, requestAvatar);
+    lua_pushstring(L, request->m_Url);
+    lua_pushnumber(L, request->m_Id);
+
+    if (lua_pcall(L, 2, 0, 0) != 0) {
+        dmLogError("Error fetching avatar: %s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+
+        int index = findAvatarRequest(request->m_Id, AVATAR_HTTP);
+        AvatarRequest failed = avatarRequests[index];
+        avatarRequests.EraseSwap(index);
+        deliverAvatarError(&failed, "could not start HTTP request");
+    }
+    assert(top == lua_gettop(L));
+}
+
+static void dispatchAvatars()
+{
+    uint64_t now = dmTime::GetTime();
+    for (uint32_t i = 0; i < avatarRequests.Size(); i++) {
+        AvatarRequest * request = &avatarRequests[i];
+
+        if (request->m_State == AVATAR_HTTP && now >= request->m_Deadline) {
+            AvatarRequest expired = *request;
+            avatarRequests.EraseSwap(i);
+            i -= 1;
+            deliverAvatarError(&expired, "HTTP request timed out");
+            continue;
+        }
+        if (request->m_State != AVATAR_MEMORY) { continue; }
+
+        AvatarImage * image = findAvatarImage(request->m_Key);
+        if (!image) {
+            request->m_State = AVATAR_DISK;
+            request->m_JobId = DiscordRich_loadAvatar(request->m_Name);
+            continue;
+        }
+
+        // Callbacks can issue new requests, so don't hold on to pointers into the array
+        AvatarRequest hit = *request;
+        int ref = image->m_Ref;
+        avatarRequests.EraseSwap(i);
+        i -= 1;
+        deliverAvatarImage(&hit, ref);
+    }
+
+    DiscordRich_AvatarResult result;
+    while (DiscordRich_pollAvatar(&result)) {
+        int index = findAvatarRequest(result.jobId, AVATAR_DISK);
+        if (index < 0) { index = findAvatarRequest(result.jobId, AVATAR_DECODE); }
+
+        if (index >= 0 && result.status == DISCORDRICH_AVATAR_MISSING) {
+            fetchAvatar(&avatarRequests[index]);
+        } else if (index >= 0) {
+            AvatarRequest request = avatarRequests[index];
+            avatarRequests.EraseSwap(index);
+
+            if (result.status == DISCORDRICH_AVATAR_DECODED) {
+                lua_State * L = request.m_Callback.m_L;
+                pushAvatarImage(L, &result);
+                addAvatarImage(L, request.m_Key, result.width * result.height * 4);
+                deliverAvatar(&request, 1);
+            } else {
+                deliverAvatarError(&request, "could not decode avatar");
+            }
+        }
+        DiscordRich_freeAvatarResult(&result);
+    }
+}
+
+static bool freeAvatars(lua_State * L, uint64_t deadline)
+{
+    bool completed = DiscordRich_finalizeAvatarCache(deadline);
+
+    for (uint32_t i = 0; i < avatarRequests.Size(); i++) {
+        clearCallback(&avatarRequests[i].m_Callback);
+    }
+    avatarRequests.SetSize(0);
+
+    while (avatarImages.Size()) {
+        removeAvatarImage(L, avatarImages.Size() - 1);
+    }
+    return completed;
+}
+
+static int get_avatar(lua_State *L)
+{
+    const char * userId = luaL_checkstring(L, 1);
+    const char * avatar = luaL_checkstring(L, 2);
+    int size = (int)luaL_optinteger(L, 3, 128);
+    luaL_argcheck(L, size >= DISCORDRICH_AVATAR_MIN_SIZE && size <= DISCORDRICH_AVATAR_MAX_SIZE && !(size & (size - 1)), 3,
+        "must be a power of 2 between 16 and 4096");
+    luaL_checktype(L, 4, LUA_TFUNCTION);
+
+    if (avatarRequests.Full()) {
+        avatarRequests.OffsetCapacity(8);
+    }
+
+    AvatarRequest request;
+    if (!DiscordRich_getAvatarUrl(request.m_Url, sizeof(request.m_Url), userId, avatar, size)) {
+        return luaL_error(L, "invalid user id or avatar");
+    }
+    DiscordRich_getAvatarKey(request.m_Name, sizeof(request.m_Name), userId, avatar, size);
+    request.m_Key = dmHashString64(request.m_Name);
+    request.m_Id = ++avatarNextRequestId;
+    request.m_JobId = 0;
+    request.m_State = AVATAR_MEMORY;
+    request.m_Deadline = 0;
+    setCallback(L, 4, &request.m_Callback);
+
+    avatarRequests.Push(request);
+    return 0;
+}
+
+static int create_secrets(lua_State *L)
+{
+    size_t lobbyLen;
+    const char * lobby = luaL_checklstring(L, 1, &lobbyLen);
+    luaL_argcheck(L, lobbyLen <= DISCORDRICH_LOBBY_MAX, 1, "lobby is too long");
+    luaL_argcheck(L, strlen(lobby) == lobbyLen, 1, "lobby can't contain zeros");
+    double ttl = luaL_optnumber(L, 2, 0);
+
+    char secrets[DISCORDRICH_SECRET_KIND_COUNT][DISCORDRICH_SECRET_MAX + 1];
+    if (!DiscordRich_createSecrets(lobby, lobbyLen, ttl > 0 ? (uint64_t)(ttl * 1000000.0) : 0, secrets)) {
+        return luaL_error(L, "could not generate secrets");
+    }
+
+    lua_newtable(L);
+    lua_pushstring(L, secrets[DISCORDRICH_SECRET_JOIN]);
+    lua_setfield(L, -2, "join_secret");
+    lua_pushstring(L, secrets[DISCORDRICH_SECRET_SPECTATE]);
+    lua_setfield(L, -2, "spectate_secret");
+    lua_pushstring(L, secrets[DISCORDRICH_SECRET_MATCH]);
+    lua_setfield(L, -2, "match_secret");
+    return 1;
+}
+
+static int resolve_secret(lua_State *L)
+{
+    const char * secret = luaL_checkstring(L, 1);
+    int kind;
+    const char * lobby = DiscordRich_resolveSecret(secret, &kind);
+    if (!lobby) { return 0; }
+    lua_pushstring(L, lobby);
+    lua_pushnumber(L, kind);
+    return 2;
+}
+
+static int revoke_secrets(lua_State *L)
+{
+    const char * secret = luaL_checkstring(L, 1);
+    lua_pushboolean(L, DiscordRich_revokeSecrets(secret));
+    return 1;
+}
+
+static int get_errors(lua_State *L)
+{
+    uint32_t start;
+    const DiscordRich_ErrorEntry * entries = DiscordRich_getErrors(&start);
+
+    lua_newtable(L);
+    int n = 0;
+    for (uint32_t i = 0; i < DISCORDRICH_ERROR_SLOTS; i++) {
+        const DiscordRich_ErrorEntry * entry = &entries[(start + i) % DISCORDRICH_ERROR_SLOTS];
+        if (!entry->count) { continue; }
+
+        lua_newtable(L);
+        lua_pushstring(L, entry->message);
+        lua_setfield(L, -2, "message");
+        if (entry->traceback[0]) {
+            lua_pushstring(L, entry->traceback);
+            lua_setfield(L, -2, "traceback");
+        }
+        lua_pushnumber(L, entry->count);
+        lua_setfield(L, -2, "count");
+        lua_pushnumber(L, entry->firstTime / 1000000.0);
+        lua_setfield(L, -2, "first_time");
+        lua_pushnumber(L, entry->lastTime / 1000000.0);
+        lua_setfield(L, -2, "last_time");
+        lua_rawseti(L, -2, ++n);
+    }
+    return 1;
+}
+
+static int clear_errors(lua_State *L)
+{
+    DiscordRich_clearErrors();
+    return 0;
+}
+
+static int get_backend(lua_State *L)
+{
+    lua_pushstring(L, DiscordRich_backend->name);
+    return 1;
+}
+
+static void pushPresenceFields(lua_State * L, const DiscordRich_PresenceFields * fields)
+{
+    lua_newtable(L);
+    for (int field = 0; field < DISCORDRICH_FIELD_COUNT; field++) {
+        if (!(fields->mask & (1u << field))) { continue; }
+        const DiscordRich_FieldInfo * info = DiscordRich_getFieldInfo(field);
+        if (info->isString) {
+            lua_pushstring(L, fields->strings[field]);
+        } else {
+            lua_pushnumber(L, (lua_Number)fields->numbers[field]);
+        }
+        lua_setfield(L, -2, info->name);
+    }
+}
+
+static int get_recorded_calls(lua_State *L)
+{
+    if (!DiscordRich_isRecordingBackend()) {
+        return luaL_error(L, "the recording backend is not in use");
+    }
+
+    bool reset = !lua_isnoneornil(L, 1) && check_boolean(L, 1);
+    static DiscordRich_RecordedCalls calls;
+    DiscordRich_getRecordedCalls(&calls, reset);
+
+    lua_newtable(L);
+#define push_count(tname, fname) \
+    lua_pushnumber(L, calls.fname); \
+    lua_setfield(L, -2, tname)
+
+    push_count("initialize", initialize);
+    push_count("shutdown", shutdown);
+    push_count("run_callbacks", runCallbacks);
+    push_count("update_presence", updatePresence);
+    push_count("clear_presence", clearPresence);
+    push_count("respond", respond);
+    push_count("update_handlers", updateHandlers);
+    push_count("register", registerCommand);
+    push_count("register_steam_game", registerSteamGame);
+
+#undef push_count
+
+    if (calls.applicationId[0]) {
+        lua_pushstring(L, calls.applicationId);
+        lua_setfield(L, -2, "application_id");
+    }
+    if (calls.hasPresence) {
+        pushPresenceFields(L, &calls.presence);
+        lua_setfield(L, -2, "presence");
+    }
+    return 1;
+}
+
+static int get_state(lua_State *L)
+{
+    lua_pushnumber(L, discordState);
+    return 1;
+}
+
 static int update_handlers(lua_State *L)
 {
-    if (!discordInitialized) { return 0; }
-    if (!sym_Discord_UpdateHandlers) { return 0; }
+    if (!isSessionActive()) { return 0; }
+    if (!DiscordRich_backend->updateHandlers) { return 0; }
     freeHandlers();
 
     DiscordEventHandlers handlers;
     saveHandlers(L, 1, &handlers);
 
-    sym_Discord_UpdateHandlers(&handlers);
+    if (DiscordRich_brokerRole() != DISCORDRICH_BROKER_CLIENT) {
+        DiscordRich_backend->updateHandlers(&handlers);
+    }
+    attachHandlers();
     return 0;
 }
 
@@ -355,10 +1439,32 @@ static const luaL_reg Module_methods[] =
     {"shutdown", shutdown},
     {"register", register_},
     {"register_steam_game", register_steam_game},
+    {"get_register_status", get_register_status},
     {"update_presence", update_presence},
     {"clear_presence", clear_presence},
+    {"set_layer", set_layer},
+    {"clear_layer", clear_layer},
+    {"compile_template", compile_template},
+    {"render_template", render_template},
+    {"set_layer_text", set_layer_text},
+    {"set_number_format", set_number_format},
     {"respond", respond},
     {"update_handlers", update_handlers},
+    {"get_state", get_state},
+    {"get_backend", get_backend},
+    {"get_broker_role", get_broker_role},
+    {"get_recorded_calls", get_recorded_calls},
+    {"get_avatar", get_avatar},
+    {"create_secrets", create_secrets},
+    {"resolve_secret", resolve_secret},
+    {"revoke_secrets", revoke_secrets},
+    {"get_errors", get_errors},
+    {"clear_errors", clear_errors},
+    {"start_capture", start_capture},
+    {"stop_capture", stop_capture},
+    {"replay", replay},
+    {"stop_replay", stop_replay},
+    {"is_replaying", is_replaying},
     {0, 0}
 };
 
@@ -376,10 +1482,80 @@ static void LuaInit(lua_State* L)
     lua_pushnumber(L, DISCORD_REPLY_IGNORE);
     lua_setfield(L, -2, "REPLY_IGNORE");
 
+    lua_pushnumber(L, STATE_UNLOADED);
+    lua_setfield(L, -2, "STATE_UNLOADED");
+    lua_pushnumber(L, STATE_LOADED);
+    lua_setfield(L, -2, "STATE_LOADED");
+    lua_pushnumber(L, STATE_CONNECTING);
+    lua_setfield(L, -2, "STATE_CONNECTING");
+    lua_pushnumber(L, STATE_READY);
+    lua_setfield(L, -2, "STATE_READY");
+    lua_pushnumber(L, STATE_DISCONNECTED);
+    lua_setfield(L, -2, "STATE_DISCONNECTED");
+    lua_pushnumber(L, STATE_SHUTTING_DOWN);
+    lua_setfield(L, -2, "STATE_SHUTTING_DOWN");
+
+    lua_pushnumber(L, DISCORDRICH_REGISTER_NONE);
+    lua_setfield(L, -2, "REGISTER_NONE");
+    lua_pushnumber(L, DISCORDRICH_REGISTER_PENDING);
+    lua_setfield(L, -2, "REGISTER_PENDING");
+    lua_pushnumber(L, DISCORDRICH_REGISTER_DONE);
+    lua_setfield(L, -2, "REGISTER_DONE");
+    lua_pushnumber(L, DISCORDRICH_REGISTER_SKIPPED);
+    lua_setfield(L, -2, "REGISTER_SKIPPED");
+    lua_pushnumber(L, DISCORDRICH_REGISTER_UNAVAILABLE);
+    lua_setfield(L, -2, "REGISTER_UNAVAILABLE");
+
+    lua_pushnumber(L, DISCORDRICH_BROKER_NONE);
+    lua_setfield(L, -2, "BROKER_NONE");
+    lua_pushnumber(L, DISCORDRICH_BROKER_OWNER);
+    lua_setfield(L, -2, "BROKER_OWNER");
+    lua_pushnumber(L, DISCORDRICH_BROKER_CLIENT);
+    lua_setfield(L, -2, "BROKER_CLIENT");
+
+    lua_pushnumber(L, DISCORDRICH_SECRET_JOIN);
+    lua_setfield(L, -2, "SECRET_JOIN");
+    lua_pushnumber(L, DISCORDRICH_SECRET_SPECTATE);
+    lua_setfield(L, -2, "SECRET_SPECTATE");
+    lua_pushnumber(L, DISCORDRICH_SECRET_MATCH);
+    lua_setfield(L, -2, "SECRET_MATCH");
+
     lua_pop(L, 1);
     assert(top == lua_gettop(L));
 }
 
+static void ErrorsInit(lua_State* L, dmConfigFile::HConfig appConfig)
+{
+    float interval = dmConfigFile::GetFloat(appConfig, "discordrich.error_summary_interval", 10.0f);
+    DiscordRich_setErrorSummaryInterval((uint64_t)(interval * 1000000.0f));
+    int32_t logLimit = dmConfigFile::GetInt(appConfig, "discordrich.error_log_limit", DISCORDRICH_ERROR_LOG_LIMIT);
+    DiscordRich_setErrorLogLimit(logLimit < 0 ? 0 : (uint32_t)logLimit);
+
+    if (dmConfigFile::GetInt(appConfig, "discordrich.error_traceback", 0)) {
+        lua_getglobal(L, "debug");
+        lua_getfield(L, -1, "traceback");
+        lua_remove(L, -2);
+        tracebackHandler = dmScript::Ref(L, LUA_REGISTRYINDEX);
+    }
+}
+
+// Starts the connection during engine boot if discordrich.application_id is set.
+// The handshake then runs while the first collection loads
+static void AutoInitialize(dmConfigFile::HConfig appConfig)
+{
+    const char * applicationId = dmConfigFile::GetString(appConfig, "discordrich.application_id", "");
+    if (!applicationId[0]) { return; }
+    if (!DiscordRich_backend->initialize) { return; }
+
+    bool autoRegister = dmConfigFile::GetInt(appConfig, "discordrich.auto_register", 1) != 0;
+    const char * steamId = dmConfigFile::GetString(appConfig, "discordrich.steam_id", "");
+
+    DiscordEventHandlers handlers;
+    fillHandlers(&handlers);
+    bufferedEvents.awaitingHandlers = true;
+    startSession(applicationId, &handlers, autoRegister, steamId[0] ? steamId : NULL);
+}
+
 static dmExtension::Result AppInitializeExtension(dmExtension::AppParams* params)
 {
     return dmExtension::RESULT_OK;
@@ -391,8 +1567,25 @@ static dmExtension::Result InitializeExtension(dmExtension::Params* params)
     if (isWin7) { return dmExtension::RESULT_OK; }
     #endif
 
-    DiscordRich_openLibrary(params->m_ConfigFile);
+    DiscordRich_selectBackend(params->m_ConfigFile);
+    discordState = DiscordRich_backend->initialize ? STATE_LOADED : STATE_UNLOADED;
+
+    float timeout = dmConfigFile::GetFloat(params->m_ConfigFile, "discordrich.shutdown_timeout", 1.0f);
+    shutdownTimeout = timeout > 0 ? (uint64_t)(timeout * 1000000.0f) : 0;
+    brokerEnabled = dmConfigFile::GetInt(params->m_ConfigFile, "discordrich.broker", 0) != 0;
+
+    DiscordRich_setNumberFormat(
+        dmConfigFile::GetString(params->m_ConfigFile, "discordrich.number_group_separator", ","),
+        dmConfigFile::GetString(params->m_ConfigFile, "discordrich.number_decimal_separator", ".")
+    );
+
+    DiscordRich_initAvatarCache(params->m_ConfigFile);
+    int32_t avatarMemory = dmConfigFile::GetInt(params->m_ConfigFile, "discordrich.avatar_memory_size", DEFAULT_AVATAR_MEMORY_LIMIT);
+    avatarMemoryLimit = avatarMemory > 0 ? (uint32_t)avatarMemory : 0;
+
     LuaInit(params->m_L);
+    ErrorsInit(params->m_L, params->m_ConfigFile);
+    AutoInitialize(params->m_ConfigFile);
     return dmExtension::RESULT_OK;
 }
 
@@ -407,8 +1600,39 @@ static dmExtension::Result FinalizeExtension(dmExtension::Params* params)
     if (isWin7) { return dmExtension::RESULT_OK; }
     #endif
 
-    shutdown(params->m_L);
-    DiscordRich_closeLibrary();
+    uint64_t startTime = dmTime::GetTime();
+    uint64_t deadline = startTime + shutdownTimeout;
+
+    bool discordCompleted = shutdownSession(deadline);
+    uint64_t discordTime = dmTime::GetTime();
+
+    DiscordRich_stopReplay();
+    DiscordRich_stopCapture();
+    DiscordRich_clearPresenceLayers();
+    DiscordRich_freeTemplates();
+    DiscordRich_clearSecrets();
+    bool registerCompleted = DiscordRich_stopRegisterWorker(deadline);
+    freeRegisterCallbacks();
+    bool avatarsCompleted = freeAvatars(params->m_L, deadline);
+
+    DiscordRich_flushErrors(true);
+    if (tracebackHandler != LUA_NOREF) {
+        dmScript::Unref(params->m_L, LUA_REGISTRYINDEX, tracebackHandler);
+        tracebackHandler = LUA_NOREF;
+    }
+    uint64_t workersTime = dmTime::GetTime();
+
+    // Unloading the library under a thread that still runs its code would crash
+    bool unload = discordCompleted && registerCompleted && !DiscordRich_isShutdownPending();
+    DiscordRich_releaseBackend(unload);
+    discordState = STATE_UNLOADED;
+    uint64_t endTime = dmTime::GetTime();
+
+    dmLogInfo("Shutdown took %.1fms (discord %.1fms%s, workers %.1fms%s, library %.1fms%s)",
+        (endTime - startTime) / 1000.0,
+        (discordTime - startTime) / 1000.0, discordCompleted ? "" : " abandoned",
+        (workersTime - discordTime) / 1000.0, registerCompleted && avatarsCompleted ? "" : " abandoned",
+        (endTime - workersTime) / 1000.0, unload ? "" : " not unloaded");
     return dmExtension::RESULT_OK;
 }
 
@@ -418,9 +1642,24 @@ static dmExtension::Result UpdateExtension(dmExtension::Params* params)
     if (isWin7) { return dmExtension::RESULT_OK; }
     #endif
 
-    if (sym_Discord_RunCallbacks) {
-        sym_Discord_RunCallbacks();
+    // Nothing may call into the library while an abandoned Discord_Shutdown() still runs
+    bool shutdownPending = DiscordRich_isShutdownPending();
+    if (discordState == STATE_SHUTTING_DOWN && !shutdownPending) {
+        discordState = STATE_LOADED;
+    }
+    closeBrokerWhenIdle();
+
+    // Before new events, so the handlers get them in order
+    dispatchBufferedEvents();
+    if (DiscordRich_backend->runCallbacks && !shutdownPending) {
+        DiscordRich_backend->runCallbacks();
     }
+    dispatchBroker();
+    dispatchRegisterCallbacks();
+    dispatchReplay();
+    dispatchAvatars();
+    flushPresenceLayers();
+    DiscordRich_flushErrors(false);
     return dmExtension::RESULT_OK;
 }
 
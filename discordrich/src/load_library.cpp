@@ -56,6 +56,9 @@ void (*sym_Discord_RegisterSteamGame)(const char* applicationId, const char* ste
 #endif
 
 static dlModuleT DiscordRich_dlHandle = NULL;
+// Kept loaded because a thread might still run its code (see DiscordRich_closeLibrary).
+// Opening the library again after a reboot just adds a reference to it
+static dlModuleT leakedHandle = NULL;
 
 #if defined(_WIN32)
     #define SEP "\\"
@@ -271,7 +274,7 @@ void DiscordRich_openLibrary(dmConfigFile::HConfig appConfig)
     }
 }
 
-void DiscordRich_closeLibrary()
+void DiscordRich_closeLibrary(bool unload)
 {
     sym_Discord_Initialize = NULL;
     sym_Discord_Shutdown = NULL;
@@ -283,11 +286,19 @@ void DiscordRich_closeLibrary()
     sym_Discord_Register = NULL;
     sym_Discord_RegisterSteamGame = NULL;
 
+    if (!unload) {
+        dmLogWarning("Not unloading the Discord RPC library, since it might still be in use");
+        if (DiscordRich_dlHandle) { leakedHandle = DiscordRich_dlHandle; }
+        DiscordRich_dlHandle = NULL;
+        return;
+    }
+
     #ifdef _WIN32
     if (DiscordRich_dlHandle) { FreeLibrary(DiscordRich_dlHandle); }
     #else
     if (DiscordRich_dlHandle) { dlclose(DiscordRich_dlHandle); }
     #endif
+    DiscordRich_dlHandle = NULL;
 }
 
 #endif
@@ -0,0 +1,274 @@
+// Must come before stdlib.h for rand_s()
+#define _CRT_RAND_S
+
+#include "party.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SECRET_SEPARATOR '.'
+#define INITIAL_CAPACITY 32
+
+enum SlotState {
+    SLOT_EMPTY = 0,
+    SLOT_USED = 1,
+    SLOT_DELETED = 2, // Keeps probe chains intact until the next rehash
+};
+
+struct SecretEntry {
+    dmhash_t hash;
+    uint8_t state;
+    uint8_t kind;
+    uint32_t setId;
+    uint64_t expiry; // 0 never expires
+    char token[DISCORDRICH_SECRET_TOKEN_LENGTH + 1];
+    char lobby[DISCORDRICH_LOBBY_MAX + 1];
+};
+
+// Open addressing with linear probing. The capacity is a power of two
+static struct {
+    dmArray<SecretEntry> slots;
+    uint32_t used;    // SLOT_USED
+    uint32_t deleted; // SLOT_DELETED
+    uint32_t nextSetId;
+    // Hashes of the tokens that expired or were revoked, so that they aren't
+    // taken for the secrets of another game. Same layout, 0 marks an empty slot
+    dmArray<dmhash_t> retired;
+    uint32_t retiredCount;
+} registry;
+
+static const char tokenAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static bool fillRandom(uint8_t * buffer, size_t size)
+{
+#if defined(_WIN32)
+    for (size_t i = 0; i < size; i++) {
+        unsigned int value;
+        if (rand_s(&value) != 0) { return false; }
+        buffer[i] = (uint8_t)value;
+    }
+    return true;
+#else
+    FILE * f = fopen("/dev/urandom", "rb");
+    if (!f) { return false; }
+    bool ok = fread(buffer, 1, size, f) == size;
+    fclose(f);
+    return ok;
+#endif
+}
+
+// Returns the length of the token at the start of secret, or 0 if it isn't one of ours
+static size_t getTokenLength(const char * secret)
+{
+    const char * separator = strchr(secret, SECRET_SEPARATOR);
+    size_t len = separator ? (size_t)(separator - secret) : strlen(secret);
+    return len == DISCORDRICH_SECRET_TOKEN_LENGTH ? len : 0;
+}
+
+static SecretEntry * findSlot(dmhash_t hash, const char * token)
+{
+    if (!registry.slots.Size()) { return NULL; }
+
+    uint32_t mask = registry.slots.Size() - 1;
+    for (uint32_t i = (uint32_t)hash & mask; ; i = (i + 1) & mask) {
+        SecretEntry * entry = &registry.slots[i];
+        if (entry->state == SLOT_EMPTY) { return NULL; }
+        if (entry->state == SLOT_USED && entry->hash == hash && !memcmp(entry->token, token, DISCORDRICH_SECRET_TOKEN_LENGTH)) {
+            return entry;
+        }
+    }
+}
+
+static void insertRetired(dmhash_t hash)
+{
+    uint32_t mask = registry.retired.Size() - 1;
+    uint32_t i = (uint32_t)hash & mask;
+    while (registry.retired[i]) {
+        if (registry.retired[i] == hash) { return; }
+        i = (i + 1) & mask;
+    }
+    registry.retired[i] = hash;
+    registry.retiredCount += 1;
+}
+
+static void retireToken(dmhash_t hash)
+{
+    uint32_t capacity = registry.retired.Size();
+    if (!capacity || (registry.retiredCount + 1) * 2 > capacity) {
+        dmArray<dmhash_t> old;
+        old.Swap(registry.retired);
+
+        uint32_t newCapacity = capacity ? capacity * 2 : INITIAL_CAPACITY;
+        registry.retired.SetCapacity(newCapacity);
+        registry.retired.SetSize(newCapacity);
+        memset(registry.retired.Begin(), 0, sizeof(dmhash_t) * newCapacity);
+        registry.retiredCount = 0;
+
+        for (uint32_t i = 0; i < old.Size(); i++) {
+            if (old[i]) { insertRetired(old[i]); }
+        }
+    }
+    insertRetired(hash);
+}
+
+static bool isRetired(dmhash_t hash)
+{
+    if (!registry.retired.Size()) { return false; }
+
+    uint32_t mask = registry.retired.Size() - 1;
+    for (uint32_t i = (uint32_t)hash & mask; registry.retired[i]; i = (i + 1) & mask) {
+        if (registry.retired[i] == hash) { return true; }
+    }
+    return false;
+}
+
+static void removeSlot(SecretEntry * entry)
+{
+    retireToken(entry->hash);
+    entry->state = SLOT_DELETED;
+    registry.used -= 1;
+    registry.deleted += 1;
+}
+
+static void insertSlot(const SecretEntry * source)
+{
+    uint32_t mask = registry.slots.Size() - 1;
+    uint32_t i = (uint32_t)source->hash & mask;
+    while (registry.slots[i].state == SLOT_USED) {
+        i = (i + 1) & mask;
+    }
+    if (registry.slots[i].state == SLOT_DELETED) { registry.deleted -= 1; }
+    registry.slots[i] = *source;
+    registry.slots[i].state = SLOT_USED;
+    registry.used += 1;
+}
+
+// Makes room for count more entries. Expired and deleted entries are dropped on the way
+static void reserveSlots(uint32_t count)
+{
+    uint32_t capacity = registry.slots.Size();
+    if (capacity && (registry.used + registry.deleted + count) * 4 <= capacity * 3) { return; }
+
+    dmArray<SecretEntry> old;
+    old.Swap(registry.slots);
+
+    uint64_t now = dmTime::GetTime();
+    uint32_t live = 0;
+    for (uint32_t i = 0; i < old.Size(); i++) {
+        if (old[i].state == SLOT_USED && (!old[i].expiry || old[i].expiry > now)) { live += 1; }
+    }
+
+    uint32_t newCapacity = INITIAL_CAPACITY;
+    while ((live + count) * 2 > newCapacity) { newCapacity *= 2; }
+
+    registry.slots.SetCapacity(newCapacity);
+    registry.slots.SetSize(newCapacity);
+    memset(registry.slots.Begin(), 0, sizeof(SecretEntry) * newCapacity);
+    registry.used = 0;
+    registry.deleted = 0;
+
+    for (uint32_t i = 0; i < old.Size(); i++) {
+        if (old[i].state != SLOT_USED) { continue; }
+        if (!old[i].expiry || old[i].expiry > now) {
+            insertSlot(&old[i]);
+        } else {
+            retireToken(old[i].hash);
+        }
+    }
+}
+
+bool DiscordRich_createSecrets(const char * lobby, size_t lobbyLen, uint64_t ttl, char secrets[DISCORDRICH_SECRET_KIND_COUNT][DISCORDRICH_SECRET_MAX + 1])
+{
+    uint8_t random[DISCORDRICH_SECRET_KIND_COUNT * DISCORDRICH_SECRET_TOKEN_LENGTH];
+    if (!fillRandom(random, sizeof(random))) {
+        dmLogError("Could not get random bytes for the party secrets");
+        return false;
+    }
+    if (lobbyLen > DISCORDRICH_LOBBY_MAX) { lobbyLen = DISCORDRICH_LOBBY_MAX; }
+
+    reserveSlots(DISCORDRICH_SECRET_KIND_COUNT);
+
+    SecretEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.setId = ++registry.nextSetId;
+    entry.expiry = ttl ? dmTime::GetTime() + ttl : 0;
+    memcpy(entry.lobby, lobby, lobbyLen);
+    entry.lobby[lobbyLen] = 0;
+
+    for (int kind = 0; kind < DISCORDRICH_SECRET_KIND_COUNT; kind++) {
+        // 64 characters, so every byte maps to one without bias
+        for (int i = 0; i < DISCORDRICH_SECRET_TOKEN_LENGTH; i++) {
+            entry.token[i] = tokenAlphabet[random[kind * DISCORDRICH_SECRET_TOKEN_LENGTH + i] & 63];
+        }
+        entry.token[DISCORDRICH_SECRET_TOKEN_LENGTH] = 0;
+        entry.kind = (uint8_t)kind;
+        entry.hash = dmHashBuffer64(entry.token, DISCORDRICH_SECRET_TOKEN_LENGTH);
+        insertSlot(&entry);
+
+        snprintf(secrets[kind], DISCORDRICH_SECRET_MAX + 1, "%s%c%s", entry.token, SECRET_SEPARATOR, entry.lobby);
+    }
+    return true;
+}
+
+static SecretEntry * findSecret(const char * secret)
+{
+    if (!getTokenLength(secret)) { return NULL; }
+
+    SecretEntry * entry = findSlot(dmHashBuffer64(secret, DISCORDRICH_SECRET_TOKEN_LENGTH), secret);
+    if (entry && entry->expiry && entry->expiry <= dmTime::GetTime()) {
+        removeSlot(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+const char * DiscordRich_resolveSecret(const char * secret, int * kind)
+{
+    SecretEntry * entry = findSecret(secret);
+    if (!entry) { return NULL; }
+    if (kind) { *kind = entry->kind; }
+    return entry->lobby;
+}
+
+const char * DiscordRich_getSecretLobby(const char * secret)
+{
+    SecretEntry * entry = findSecret(secret);
+    if (entry) { return entry->lobby; }
+
+    // Only parse the secrets of other games. Ours are dead once they leave the registry
+    if (!getTokenLength(secret)) { return NULL; }
+    if (isRetired(dmHashBuffer64(secret, DISCORDRICH_SECRET_TOKEN_LENGTH))) { return NULL; }
+    const char * separator = strchr(secret, SECRET_SEPARATOR);
+    return separator ? separator + 1 : NULL;
+}
+
+bool DiscordRich_revokeSecrets(const char * secret)
+{
+    SecretEntry * entry = findSecret(secret);
+    if (!entry) { return false; }
+
+    uint32_t setId = entry->setId;
+    for (uint32_t i = 0; i < registry.slots.Size(); i++) {
+        if (registry.slots[i].state == SLOT_USED && registry.slots[i].setId == setId) {
+            removeSlot(&registry.slots[i]);
+        }
+    }
+    return true;
+}
+
+void DiscordRich_clearSecrets()
+{
+    dmArray<SecretEntry> empty;
+    registry.slots.Swap(empty);
+    registry.used = 0;
+    registry.deleted = 0;
+
+    dmArray<dmhash_t> emptyRetired;
+    registry.retired.Swap(emptyRetired);
+    registry.retiredCount = 0;
+}
+
+#endif
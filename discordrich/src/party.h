@@ -0,0 +1,43 @@
+#ifndef _PARTY_H_
+#define _PARTY_H_
+
+#include "common.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+#define DISCORDRICH_SECRET_MAX 127 // Discord rejects longer secrets
+#define DISCORDRICH_SECRET_TOKEN_LENGTH 16
+#define DISCORDRICH_LOBBY_MAX (DISCORDRICH_SECRET_MAX - DISCORDRICH_SECRET_TOKEN_LENGTH - 1)
+
+enum DiscordRich_SecretKind {
+    DISCORDRICH_SECRET_JOIN = 0,
+    DISCORDRICH_SECRET_SPECTATE = 1,
+    DISCORDRICH_SECRET_MATCH = 2,
+    DISCORDRICH_SECRET_KIND_COUNT = 3,
+};
+
+// Secrets are a random token followed by "." and the lobby payload. Discord
+// only hands a secret to the games of other players, so the lobby has to
+// travel inside it. The game that generated the secrets also keeps them in a
+// hash table with an expiry time, to check the secrets that players present
+// back to it (eg. when connecting to the lobby).
+
+// Generates one secret of each kind for lobby. ttl is in microseconds, 0 never
+// expires. Returns false if no random bytes were available
+bool DiscordRich_createSecrets(const char * lobby, size_t lobbyLen, uint64_t ttl, char secrets[DISCORDRICH_SECRET_KIND_COUNT][DISCORDRICH_SECRET_MAX + 1]);
+
+// Looks up a secret generated by this game. Returns its lobby, or NULL if the
+// secret is unknown, expired or was revoked
+const char * DiscordRich_resolveSecret(const char * secret, int * kind);
+
+// The lobby a secret from any game carries, or NULL if it isn't in our format.
+// Prefers the registry when the secret is ours, and returns NULL once it
+// expired or was revoked. Valid until the registry changes
+const char * DiscordRich_getSecretLobby(const char * secret);
+
+// Revokes every secret created along with this one
+bool DiscordRich_revokeSecrets(const char * secret);
+void DiscordRich_clearSecrets();
+
+#endif
+#endif
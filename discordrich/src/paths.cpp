@@ -0,0 +1,127 @@
+#include "common.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#endif
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+    #define SEP "\\"
+#else
+    #define SEP "/"
+#endif
+
+bool DiscordRich_getExecutablePath(char * buffer, size_t bufferSize)
+{
+    if (!bufferSize) { return false; }
+    buffer[0] = 0;
+
+    #if defined(__APPLE__)
+    uint32_t size = (uint32_t)bufferSize;
+    if (_NSGetExecutablePath(buffer, &size) != 0) {
+        buffer[0] = 0;
+        return false;
+    }
+    return true;
+
+    #elif defined(__linux__)
+    ssize_t ret = readlink("/proc/self/exe", buffer, bufferSize - 1);
+    if (ret < 0) {
+        buffer[0] = 0;
+        return false;
+    }
+    buffer[ret] = 0;
+    return true;
+
+    #elif defined(_WIN32)
+    DWORD ret = GetModuleFileNameA(GetModuleHandle(NULL), buffer, (DWORD)bufferSize);
+    if (ret == 0 || ret >= bufferSize) {
+        buffer[0] = 0;
+        return false;
+    }
+    return true;
+
+    #else
+    return false;
+    #endif
+}
+
+static bool makeDir(const char * path)
+{
+    #ifdef _WIN32
+    return _mkdir(path) == 0 || errno == EEXIST;
+    #else
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+    #endif
+}
+
+bool DiscordRich_getDataPath(char * buffer, size_t bufferSize, const char * fileName)
+{
+    if (!bufferSize) { return false; }
+    buffer[0] = 0;
+
+    char* env = NULL;
+    const char * suffix = "";
+
+    #if defined(_WIN32)
+    env = getenv("APPDATA");
+    #elif defined(__APPLE__)
+    env = getenv("HOME");
+    suffix = SEP "Library" SEP "Application Support";
+    #else
+    env = getenv("XDG_DATA_HOME");
+    if (!env || !env[0]) {
+        env = getenv("HOME");
+        suffix = SEP ".local" SEP "share";
+    }
+    #endif
+
+    if (!env || !env[0]) { return false; }
+
+    int len = snprintf(buffer, bufferSize, "%s%s", env, suffix);
+    if (len < 0 || (size_t)len >= bufferSize) {
+        buffer[0] = 0;
+        return false;
+    }
+    makeDir(buffer);
+
+    size_t dirLen = (size_t)len;
+    len = snprintf(buffer + dirLen, bufferSize - dirLen, SEP "discordrich");
+    if (len < 0 || dirLen + len >= bufferSize) {
+        buffer[0] = 0;
+        return false;
+    }
+    if (!makeDir(buffer)) {
+        dmLogWarning("Could not create data directory \"%s\"", buffer);
+        buffer[0] = 0;
+        return false;
+    }
+
+    if (fileName) {
+        dirLen += len;
+        len = snprintf(buffer + dirLen, bufferSize - dirLen, SEP "%s", fileName);
+        if (len < 0 || dirLen + len >= bufferSize) {
+            buffer[0] = 0;
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,308 @@
+#include "presence.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+#include <string.h>
+
+static const DiscordRich_FieldInfo fieldInfo[DISCORDRICH_FIELD_COUNT] = {
+    { "state", true, 128 },
+    { "details", true, 128 },
+    { "start_timestamp", false, 0 },
+    { "end_timestamp", false, 0 },
+    { "large_image_key", true, 32 },
+    { "large_image_text", true, 128 },
+    { "small_image_key", true, 32 },
+    { "small_image_text", true, 128 },
+    { "party_id", true, 128 },
+    { "party_size", false, 0 },
+    { "party_max", false, 0 },
+    { "match_secret", true, 128 },
+    { "join_secret", true, 128 },
+    { "spectate_secret", true, 128 },
+    { "instance", false, 0 },
+};
+
+const DiscordRich_FieldInfo * DiscordRich_getFieldInfo(int field)
+{
+    if (field < 0 || field >= DISCORDRICH_FIELD_COUNT) { return NULL; }
+    return &fieldInfo[field];
+}
+
+int DiscordRich_findField(const char * name)
+{
+    for (int field = 0; field < DISCORDRICH_FIELD_COUNT; field++) {
+        if (!strcmp(fieldInfo[field].name, name)) { return field; }
+    }
+    return -1;
+}
+
+size_t DiscordRich_trimUtf8(const char * str, size_t len)
+{
+    size_t i = len;
+    while (i > 0 && (str[i - 1] & 0xC0) == 0x80) { i -= 1; }
+    if (i == 0) { return len; }
+
+    unsigned char lead = (unsigned char)str[i - 1];
+    size_t expected = 1;
+    if ((lead & 0xE0) == 0xC0) { expected = 2; }
+    else if ((lead & 0xF0) == 0xE0) { expected = 3; }
+    else if ((lead & 0xF8) == 0xF0) { expected = 4; }
+
+    return len - (i - 1) < expected ? i - 1 : len;
+}
+
+void DiscordRich_clearFields(DiscordRich_PresenceFields * fields)
+{
+    fields->mask = 0;
+}
+
+void DiscordRich_setStringField(DiscordRich_PresenceFields * fields, int field, const char * value, size_t len)
+{
+    size_t maxLength = fieldInfo[field].maxLength;
+    if (len > maxLength) { len = DiscordRich_trimUtf8(value, maxLength); }
+    memcpy(fields->strings[field], value, len);
+    fields->strings[field][len] = 0;
+    fields->mask |= 1u << field;
+}
+
+void DiscordRich_setNumberField(DiscordRich_PresenceFields * fields, int field, int64_t value)
+{
+    fields->numbers[field] = value;
+    fields->mask |= 1u << field;
+}
+
+static bool hasField(const DiscordRich_PresenceFields * fields, int field)
+{
+    return (fields->mask & (1u << field)) != 0;
+}
+
+void DiscordRich_copyField(DiscordRich_PresenceFields * dest, const DiscordRich_PresenceFields * src, int field)
+{
+    if (fieldInfo[field].isString) {
+        strcpy(dest->strings[field], src->strings[field]);
+    } else {
+        dest->numbers[field] = src->numbers[field];
+    }
+    dest->mask |= 1u << field;
+}
+
+static bool fieldsEqual(const DiscordRich_PresenceFields * a, const DiscordRich_PresenceFields * b)
+{
+    if (a->mask != b->mask) { return false; }
+    for (int field = 0; field < DISCORDRICH_FIELD_COUNT; field++) {
+        if (!hasField(a, field)) { continue; }
+        if (fieldInfo[field].isString) {
+            if (strcmp(a->strings[field], b->strings[field])) { return false; }
+        } else {
+            if (a->numbers[field] != b->numbers[field]) { return false; }
+        }
+    }
+    return true;
+}
+
+void DiscordRich_fieldsToPresence(const DiscordRich_PresenceFields * fields, DiscordRichPresence * presence)
+{
+    memset(presence, 0, sizeof(*presence));
+
+#define string_field(id, fname) \
+    if (hasField(fields, id)) { presence->fname = fields->strings[id]; }
+#define number_field(id, fname, type) \
+    if (hasField(fields, id)) { presence->fname = (type)fields->numbers[id]; }
+
+    string_field(DISCORDRICH_FIELD_STATE, state);
+    string_field(DISCORDRICH_FIELD_DETAILS, details);
+    number_field(DISCORDRICH_FIELD_START_TIMESTAMP, startTimestamp, int64_t);
+    number_field(DISCORDRICH_FIELD_END_TIMESTAMP, endTimestamp, int64_t);
+    string_field(DISCORDRICH_FIELD_LARGE_IMAGE_KEY, largeImageKey);
+    string_field(DISCORDRICH_FIELD_LARGE_IMAGE_TEXT, largeImageText);
+    string_field(DISCORDRICH_FIELD_SMALL_IMAGE_KEY, smallImageKey);
+    string_field(DISCORDRICH_FIELD_SMALL_IMAGE_TEXT, smallImageText);
+    string_field(DISCORDRICH_FIELD_PARTY_ID, partyId);
+    number_field(DISCORDRICH_FIELD_PARTY_SIZE, partySize, int);
+    number_field(DISCORDRICH_FIELD_PARTY_MAX, partyMax, int);
+    string_field(DISCORDRICH_FIELD_MATCH_SECRET, matchSecret);
+    string_field(DISCORDRICH_FIELD_JOIN_SECRET, joinSecret);
+    string_field(DISCORDRICH_FIELD_SPECTATE_SECRET, spectateSecret);
+    number_field(DISCORDRICH_FIELD_INSTANCE, instance, int8_t);
+
+#undef string_field
+#undef number_field
+}
+
+void DiscordRich_presenceToFields(const DiscordRichPresence * presence, DiscordRich_PresenceFields * fields)
+{
+    fields->mask = 0;
+
+#define string_field(id, fname) \
+    if (presence->fname) { DiscordRich_setStringField(fields, id, presence->fname, strlen(presence->fname)); }
+#define number_field(id, fname) \
+    if (presence->fname) { DiscordRich_setNumberField(fields, id, presence->fname); }
+
+    string_field(DISCORDRICH_FIELD_STATE, state);
+    string_field(DISCORDRICH_FIELD_DETAILS, details);
+    number_field(DISCORDRICH_FIELD_START_TIMESTAMP, startTimestamp);
+    number_field(DISCORDRICH_FIELD_END_TIMESTAMP, endTimestamp);
+    string_field(DISCORDRICH_FIELD_LARGE_IMAGE_KEY, largeImageKey);
+    string_field(DISCORDRICH_FIELD_LARGE_IMAGE_TEXT, largeImageText);
+    string_field(DISCORDRICH_FIELD_SMALL_IMAGE_KEY, smallImageKey);
+    string_field(DISCORDRICH_FIELD_SMALL_IMAGE_TEXT, smallImageText);
+    string_field(DISCORDRICH_FIELD_PARTY_ID, partyId);
+    number_field(DISCORDRICH_FIELD_PARTY_SIZE, partySize);
+    number_field(DISCORDRICH_FIELD_PARTY_MAX, partyMax);
+    string_field(DISCORDRICH_FIELD_MATCH_SECRET, matchSecret);
+    string_field(DISCORDRICH_FIELD_JOIN_SECRET, joinSecret);
+    string_field(DISCORDRICH_FIELD_SPECTATE_SECRET, spectateSecret);
+    number_field(DISCORDRICH_FIELD_INSTANCE, instance);
+
+#undef string_field
+#undef number_field
+}
+
+// Layers
+
+struct PresenceLayer {
+    dmhash_t name;
+    int priority;
+    uint32_t sequence;
+    DiscordRich_PresenceFields fields;
+};
+
+static struct {
+    // Sorted by (priority, sequence), so merging in order lets the winner write last
+    dmArray<PresenceLayer *> layers;
+    uint32_t sequence;
+    bool dirty;
+
+    bool hasLast;
+    DiscordRich_PresenceFields merged;
+    DiscordRich_PresenceFields last;
+} compositor;
+
+static bool layerLess(const PresenceLayer * a, const PresenceLayer * b)
+{
+    if (a->priority != b->priority) { return a->priority < b->priority; }
+    return a->sequence < b->sequence;
+}
+
+static int findLayer(dmhash_t name)
+{
+    for (uint32_t i = 0; i < compositor.layers.Size(); i++) {
+        if (compositor.layers[i]->name == name) { return (int)i; }
+    }
+    return -1;
+}
+
+static PresenceLayer * detachLayer(uint32_t index)
+{
+    PresenceLayer * layer = compositor.layers[index];
+    for (uint32_t i = index + 1; i < compositor.layers.Size(); i++) {
+        compositor.layers[i - 1] = compositor.layers[i];
+    }
+    compositor.layers.SetSize(compositor.layers.Size() - 1);
+    return layer;
+}
+
+void DiscordRich_setPresenceLayer(const char * name, int priority, const DiscordRich_PresenceFields * fields)
+{
+    dmhash_t hash = dmHashString64(name);
+    PresenceLayer * layer;
+
+    int index = findLayer(hash);
+    if (index >= 0) {
+        layer = detachLayer(index);
+    } else {
+        layer = new PresenceLayer;
+        layer->name = hash;
+    }
+
+    layer->priority = priority;
+    layer->sequence = ++compositor.sequence;
+    layer->fields.mask = 0;
+    for (int field = 0; field < DISCORDRICH_FIELD_COUNT; field++) {
+        if (hasField(fields, field)) { DiscordRich_copyField(&layer->fields, fields, field); }
+    }
+
+    // Insert in order
+    if (compositor.layers.Full()) {
+        compositor.layers.OffsetCapacity(8);
+    }
+    compositor.layers.SetSize(compositor.layers.Size() + 1);
+    uint32_t i = compositor.layers.Size() - 1;
+    while (i > 0 && layerLess(layer, compositor.layers[i - 1])) {
+        compositor.layers[i] = compositor.layers[i - 1];
+        i -= 1;
+    }
+    compositor.layers[i] = layer;
+
+    compositor.dirty = true;
+}
+
+bool DiscordRich_clearPresenceLayer(const char * name)
+{
+    int index = findLayer(dmHashString64(name));
+    if (index < 0) { return false; }
+    delete detachLayer(index);
+    compositor.dirty = true;
+    return true;
+}
+
+char * DiscordRich_editPresenceLayerField(const char * name, int field)
+{
+    int index = findLayer(dmHashString64(name));
+    if (index < 0) { return NULL; }
+
+    PresenceLayer * layer = compositor.layers[index];
+    layer->fields.mask |= 1u << field;
+    compositor.dirty = true;
+    return layer->fields.strings[field];
+}
+
+void DiscordRich_clearPresenceLayers()
+{
+    for (uint32_t i = 0; i < compositor.layers.Size(); i++) {
+        delete compositor.layers[i];
+    }
+    compositor.layers.SetSize(0);
+    compositor.dirty = false;
+    compositor.hasLast = false;
+}
+
+bool DiscordRich_composePresence(DiscordRichPresence * presence, bool * clear)
+{
+    if (!compositor.dirty) { return false; }
+    compositor.dirty = false;
+
+    DiscordRich_PresenceFields * merged = &compositor.merged;
+    merged->mask = 0;
+    for (uint32_t i = 0; i < compositor.layers.Size(); i++) {
+        const DiscordRich_PresenceFields * fields = &compositor.layers[i]->fields;
+        for (int field = 0; field < DISCORDRICH_FIELD_COUNT; field++) {
+            if (hasField(fields, field)) { DiscordRich_copyField(merged, fields, field); }
+        }
+    }
+
+    if (compositor.hasLast && fieldsEqual(merged, &compositor.last)) { return false; }
+
+    // Nothing was ever sent from the layers, so there's nothing to clear either
+    if (!compositor.hasLast && !merged->mask) { return false; }
+
+    memcpy(&compositor.last, merged, sizeof(*merged));
+    compositor.hasLast = true;
+
+    *clear = !merged->mask;
+    DiscordRich_fieldsToPresence(merged, presence);
+    return true;
+}
+
+void DiscordRich_invalidatePresence()
+{
+    compositor.hasLast = false;
+}
+
+void DiscordRich_resendPresence()
+{
+    compositor.hasLast = false;
+    compositor.dirty = compositor.layers.Size() > 0;
+}
+
+#endif
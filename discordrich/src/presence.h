@@ -0,0 +1,85 @@
+#ifndef _PRESENCE_H_
+#define _PRESENCE_H_
+
+#include "common.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+enum DiscordRich_PresenceField {
+    DISCORDRICH_FIELD_STATE,
+    DISCORDRICH_FIELD_DETAILS,
+    DISCORDRICH_FIELD_START_TIMESTAMP,
+    DISCORDRICH_FIELD_END_TIMESTAMP,
+    DISCORDRICH_FIELD_LARGE_IMAGE_KEY,
+    DISCORDRICH_FIELD_LARGE_IMAGE_TEXT,
+    DISCORDRICH_FIELD_SMALL_IMAGE_KEY,
+    DISCORDRICH_FIELD_SMALL_IMAGE_TEXT,
+    DISCORDRICH_FIELD_PARTY_ID,
+    DISCORDRICH_FIELD_PARTY_SIZE,
+    DISCORDRICH_FIELD_PARTY_MAX,
+    DISCORDRICH_FIELD_MATCH_SECRET,
+    DISCORDRICH_FIELD_JOIN_SECRET,
+    DISCORDRICH_FIELD_SPECTATE_SECRET,
+    DISCORDRICH_FIELD_INSTANCE,
+    DISCORDRICH_FIELD_COUNT,
+};
+
+// Longest string field allowed by discord_rpc.h, without the terminator
+#define DISCORDRICH_FIELD_MAX 128
+
+struct DiscordRich_FieldInfo {
+    const char * name;   // Lua name, as used by update_presence()
+    bool isString;
+    size_t maxLength;    // For strings, from discord_rpc.h
+};
+
+const DiscordRich_FieldInfo * DiscordRich_getFieldInfo(int field);
+// Returns -1 if there's no field with that Lua name
+int DiscordRich_findField(const char * name);
+
+struct DiscordRich_PresenceFields {
+    uint32_t mask; // Bit (1 << field) is set for every field that has a value
+    char strings[DISCORDRICH_FIELD_COUNT][DISCORDRICH_FIELD_MAX + 1];
+    int64_t numbers[DISCORDRICH_FIELD_COUNT];
+};
+
+// Returns len shortened so str doesn't end in a cut UTF-8 sequence. For
+// strings truncated at a byte limit
+size_t DiscordRich_trimUtf8(const char * str, size_t len);
+
+void DiscordRich_clearFields(DiscordRich_PresenceFields * fields);
+// Truncates to the field's limit, on a UTF-8 character boundary
+void DiscordRich_setStringField(DiscordRich_PresenceFields * fields, int field, const char * value, size_t len);
+void DiscordRich_setNumberField(DiscordRich_PresenceFields * fields, int field, int64_t value);
+// Copies one field (set in src) into dest
+void DiscordRich_copyField(DiscordRich_PresenceFields * dest, const DiscordRich_PresenceFields * src, int field);
+
+// Points presence at the values in fields
+void DiscordRich_fieldsToPresence(const DiscordRich_PresenceFields * fields, DiscordRichPresence * presence);
+// Copies presence into fields. NULL strings and zero numbers are left unset
+void DiscordRich_presenceToFields(const DiscordRichPresence * presence, DiscordRich_PresenceFields * fields);
+
+// Presence layers. Each layer owns some of the fields. On conflicts, the layer
+// with the higher priority (or, on equal priority, the most recently set one) wins
+void DiscordRich_setPresenceLayer(const char * name, int priority, const DiscordRich_PresenceFields * fields);
+bool DiscordRich_clearPresenceLayer(const char * name);
+
+// Returns the buffer of a string field of a layer, to be written in place
+// (up to the field's maxLength + 1 bytes). The field is marked as set.
+// Returns NULL if the layer doesn't exist
+char * DiscordRich_editPresenceLayerField(const char * name, int field);
+void DiscordRich_clearPresenceLayers();
+
+// Merges the layers if any of them changed. Returns true if the merged result
+// differs from the last one returned. *clear is set if no layer has any field.
+// The presence stays valid until the next call
+bool DiscordRich_composePresence(DiscordRichPresence * presence, bool * clear);
+
+// Forgets the last merged result (eg. after update_presence() bypassed the layers)
+void DiscordRich_invalidatePresence();
+
+// Makes the next DiscordRich_composePresence() send the layers again (eg. for a new session)
+void DiscordRich_resendPresence();
+
+#endif
+#endif
@@ -0,0 +1,323 @@
+#include "register.h"
+#include "shutdown.h"
+#include "backend.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_APPLICATION_ID 64
+#define MAX_ARGUMENT 1024
+#define MAX_JOBS 16
+#define MAX_RECORDS 8
+
+struct RegisterJob {
+    uint32_t id;
+    bool steam;
+    bool hasArgument;
+    char applicationId[MAX_APPLICATION_ID];
+    char argument[MAX_ARGUMENT];
+};
+
+struct RegisterResult {
+    uint32_t id;
+    int status;
+};
+
+struct RegisterRecord {
+    char applicationId[MAX_APPLICATION_ID];
+    int status;
+};
+
+// Heap allocated, so that a worker that misses the shutdown deadline can be
+// abandoned along with its state and a new one started after a reboot
+struct RegisterWorker {
+    dmMutex::HMutex mutex;
+    dmConditionVariable::HConditionVariable cond;
+    dmThread::Thread thread;
+    bool running;
+    bool quit;
+    bool finished;
+    bool abandoned; // The thread frees the worker when it exits
+    uint32_t nextId;
+
+    RegisterJob jobs[MAX_JOBS];
+    uint32_t jobHead;
+    uint32_t jobCount;
+
+    RegisterResult results[MAX_JOBS];
+    uint32_t resultHead;
+    uint32_t resultCount;
+
+    RegisterRecord records[MAX_RECORDS];
+    uint32_t recordNext;
+};
+
+static RegisterWorker * worker = NULL;
+
+static void copyString(char * dest, size_t destSize, const char * src)
+{
+    strncpy(dest, src, destSize - 1);
+    dest[destSize - 1] = 0;
+}
+
+// Must be called with w->mutex held
+static void pushResult(RegisterWorker * w, uint32_t id, int status)
+{
+    if (w->resultCount == MAX_JOBS) {
+        // Nobody is polling. Drop the oldest result
+        w->resultHead = (w->resultHead + 1) % MAX_JOBS;
+        w->resultCount -= 1;
+    }
+    RegisterResult * result = &w->results[(w->resultHead + w->resultCount) % MAX_JOBS];
+    result->id = id;
+    result->status = status;
+    w->resultCount += 1;
+}
+
+// Must be called with w->mutex held
+static void setRecord(RegisterWorker * w, const char * applicationId, int status)
+{
+    for (uint32_t i = 0; i < MAX_RECORDS; i++) {
+        RegisterRecord * record = &w->records[i];
+        if (record->applicationId[0] && !strcmp(record->applicationId, applicationId)) {
+            record->status = status;
+            return;
+        }
+    }
+    RegisterRecord * record = &w->records[w->recordNext];
+    w->recordNext = (w->recordNext + 1) % MAX_RECORDS;
+    copyString(record->applicationId, MAX_APPLICATION_ID, applicationId);
+    record->status = status;
+}
+
+// register() and register_steam_game() keep separate stamps, so a game that
+// calls both doesn't redo both on every launch
+static void getStampPath(char * buffer, size_t bufferSize, const char * applicationId, bool steam)
+{
+    char fileName[MAX_APPLICATION_ID + 24];
+    size_t len = 0;
+    for (const char * c = applicationId; *c && len < MAX_APPLICATION_ID - 1; c++) {
+        bool safe = (*c >= '0' && *c <= '9') || (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || *c == '-' || *c == '_';
+        fileName[len++] = safe ? *c : '_';
+    }
+    strcpy(fileName + len, steam ? ".steam.register" : ".register");
+
+    if (!DiscordRich_getDataPath(buffer, bufferSize, fileName)) {
+        buffer[0] = 0;
+    }
+}
+
+static dmhash_t hashJob(const RegisterJob * job)
+{
+    char exePath[1024];
+    DiscordRich_getExecutablePath(exePath, sizeof(exePath));
+
+    char key[MAX_APPLICATION_ID + MAX_ARGUMENT + sizeof(exePath) + 16];
+    int len = snprintf(key, sizeof(key), "%s\n%s\n%s\n%s",
+        job->applicationId,
+        job->steam ? "steam" : (job->hasArgument ? "command" : "default"),
+        job->argument,
+        exePath
+    );
+    if (len < 0) { len = 0; }
+    if ((size_t)len >= sizeof(key)) { len = sizeof(key) - 1; }
+    return dmHashBuffer64(key, (uint32_t)len);
+}
+
+static int runJob(const RegisterJob * job)
+{
+    dmhash_t hash = hashJob(job);
+    char hashString[17];
+    snprintf(hashString, sizeof(hashString), "%016llx", (unsigned long long)hash);
+
+    // The recording backend registers nothing, so don't leave stamps behind
+    char stampPath[1024];
+    stampPath[0] = 0;
+    if (!DiscordRich_isRecordingBackend()) {
+        getStampPath(stampPath, sizeof(stampPath), job->applicationId, job->steam);
+    }
+
+    if (stampPath[0]) {
+        FILE * f = fopen(stampPath, "rb");
+        if (f) {
+            char stored[17];
+            size_t read = fread(stored, 1, 16, f);
+            fclose(f);
+            stored[read] = 0;
+            if (!strcmp(stored, hashString)) {
+                return DISCORDRICH_REGISTER_SKIPPED;
+            }
+        }
+    }
+
+    uint64_t startTime = dmTime::GetTime();
+    if (job->steam) {
+        DiscordRich_backend->registerSteamGame(job->applicationId, job->argument);
+    } else {
+        DiscordRich_backend->registerCommand(job->applicationId, job->hasArgument ? job->argument : NULL);
+    }
+    dmLogInfo("Registered application protocol for %s in %.1fms",
+        job->applicationId, (dmTime::GetTime() - startTime) / 1000.0);
+
+    if (stampPath[0]) {
+        FILE * f = fopen(stampPath, "wb");
+        if (f) {
+            fwrite(hashString, 1, 16, f);
+            fclose(f);
+        } else {
+            dmLogWarning("Could not write registration stamp \"%s\"", stampPath);
+        }
+    }
+
+    return DISCORDRICH_REGISTER_DONE;
+}
+
+static void freeWorker(RegisterWorker * w)
+{
+    dmConditionVariable::Delete(w->cond);
+    dmMutex::Delete(w->mutex);
+    delete w;
+}
+
+static void workerThread(void * arg)
+{
+    RegisterWorker * w = (RegisterWorker *)arg;
+
+    dmMutex::Lock(w->mutex);
+    while (true) {
+        while (!w->quit && !w->jobCount) {
+            dmConditionVariable::Wait(w->cond, w->mutex);
+        }
+        if (w->quit) { break; }
+
+        RegisterJob job = w->jobs[w->jobHead];
+        w->jobHead = (w->jobHead + 1) % MAX_JOBS;
+        w->jobCount -= 1;
+
+        dmMutex::Unlock(w->mutex);
+        int status = runJob(&job);
+        dmMutex::Lock(w->mutex);
+
+        pushResult(w, job.id, status);
+        setRecord(w, job.applicationId, status);
+    }
+    w->finished = true;
+    bool abandoned = w->abandoned;
+    dmMutex::Unlock(w->mutex);
+
+    // Nobody is waiting for an abandoned worker anymore
+    if (abandoned) { freeWorker(w); }
+}
+
+uint32_t DiscordRich_queueRegister(const char * applicationId, const char * command, const char * steamId)
+{
+    if (!worker) {
+        worker = new RegisterWorker;
+        memset(worker, 0, sizeof(*worker));
+        worker->mutex = dmMutex::New();
+        worker->cond = dmConditionVariable::New();
+    }
+    RegisterWorker * w = worker;
+
+    DM_MUTEX_SCOPED_LOCK(w->mutex);
+
+    if (w->jobCount == MAX_JOBS) {
+        dmLogWarning("Too many pending registrations. Ignoring registration for %s", applicationId);
+        return 0;
+    }
+
+    w->nextId += 1;
+    if (!w->nextId) { w->nextId = 1; }
+
+    // Don't bother the worker if the backend can't register (eg. the null backend)
+    if (steamId ? !DiscordRich_backend->registerSteamGame : !DiscordRich_backend->registerCommand) {
+        pushResult(w, w->nextId, DISCORDRICH_REGISTER_UNAVAILABLE);
+        setRecord(w, applicationId, DISCORDRICH_REGISTER_UNAVAILABLE);
+        return w->nextId;
+    }
+
+    RegisterJob * job = &w->jobs[(w->jobHead + w->jobCount) % MAX_JOBS];
+    job->id = w->nextId;
+    job->steam = steamId != NULL;
+    job->hasArgument = steamId || command;
+    copyString(job->applicationId, MAX_APPLICATION_ID, applicationId);
+    copyString(job->argument, MAX_ARGUMENT, steamId ? steamId : (command ? command : ""));
+    w->jobCount += 1;
+
+    setRecord(w, applicationId, DISCORDRICH_REGISTER_PENDING);
+
+    if (!w->running) {
+        w->thread = dmThread::New(workerThread, 0x80000, w, "discordrich_register");
+        w->running = true;
+    }
+    dmConditionVariable::Signal(w->cond);
+
+    return job->id;
+}
+
+bool DiscordRich_pollRegister(uint32_t * jobId, int * status)
+{
+    RegisterWorker * w = worker;
+    if (!w) { return false; }
+    DM_MUTEX_SCOPED_LOCK(w->mutex);
+
+    if (!w->resultCount) { return false; }
+    RegisterResult * result = &w->results[w->resultHead];
+    *jobId = result->id;
+    *status = result->status;
+    w->resultHead = (w->resultHead + 1) % MAX_JOBS;
+    w->resultCount -= 1;
+    return true;
+}
+
+int DiscordRich_getRegisterStatus(const char * applicationId)
+{
+    RegisterWorker * w = worker;
+    if (!w) { return DISCORDRICH_REGISTER_NONE; }
+    DM_MUTEX_SCOPED_LOCK(w->mutex);
+
+    for (uint32_t i = 0; i < MAX_RECORDS; i++) {
+        RegisterRecord * record = &w->records[i];
+        if (record->applicationId[0] && !strcmp(record->applicationId, applicationId)) {
+            return record->status;
+        }
+    }
+    return DISCORDRICH_REGISTER_NONE;
+}
+
+bool DiscordRich_stopRegisterWorker(uint64_t deadline)
+{
+    RegisterWorker * w = worker;
+    if (!w) { return true; }
+    worker = NULL;
+
+    if (w->running) {
+        dmMutex::Lock(w->mutex);
+        w->quit = true;
+        dmConditionVariable::Signal(w->cond);
+        dmMutex::Unlock(w->mutex);
+
+        // A registration can hang on a spawned process (xdg-mime). Don't wait for it forever
+        bool finished = DiscordRich_waitForFlag(w->mutex, &w->finished, deadline);
+        if (!finished) {
+            // Checked again under the lock, in case the worker just finished
+            dmMutex::Lock(w->mutex);
+            finished = w->finished;
+            w->abandoned = !finished;
+            dmMutex::Unlock(w->mutex);
+        }
+        if (!finished) {
+            dmLogWarning("Protocol registration did not finish in time. Abandoning it");
+            return false;
+        }
+
+        dmThread::Join(w->thread);
+    }
+
+    freeWorker(w);
+    return true;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef _REGISTER_H_
+#define _REGISTER_H_
+
+#include "common.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+enum DiscordRich_RegisterStatus {
+    DISCORDRICH_REGISTER_NONE = 0,
+    DISCORDRICH_REGISTER_PENDING = 1,
+    DISCORDRICH_REGISTER_DONE = 2,
+    DISCORDRICH_REGISTER_SKIPPED = 3,
+    DISCORDRICH_REGISTER_UNAVAILABLE = 4,
+};
+
+// Registrations run on a background worker. A hash of (application id,
+// command or steam id, executable path) is stored next to the user's data, one
+// per application id and kind, so that unchanged registrations are skipped on
+// later launches.
+// Returns a job id that will be reported back by DiscordRich_pollRegister()
+uint32_t DiscordRich_queueRegister(const char * applicationId, const char * command, const char * steamId);
+
+// Pops one finished job. Call from the main thread
+bool DiscordRich_pollRegister(uint32_t * jobId, int * status);
+
+// Status of the latest registration queued for applicationId
+int DiscordRich_getRegisterStatus(const char * applicationId);
+
+// Returns false if the worker was still busy at deadline (in dmTime::GetTime()
+// microseconds). It is then abandoned (the next registration starts a new
+// worker) and the library must not be unloaded
+bool DiscordRich_stopRegisterWorker(uint64_t deadline);
+
+#endif
+#endif
@@ -0,0 +1,74 @@
+#include "shutdown.h"
+#include "backend.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+static struct {
+    dmMutex::HMutex mutex;
+    dmThread::Thread thread;
+    bool pending;
+    bool done;
+    void (*shutdown)(void);
+} task;
+
+static void shutdownThread(void *)
+{
+    task.shutdown();
+
+    DM_MUTEX_SCOPED_LOCK(task.mutex);
+    task.done = true;
+}
+
+bool DiscordRich_waitForFlag(dmMutex::HMutex mutex, const bool * flag, uint64_t deadline)
+{
+    while (true) {
+        dmMutex::Lock(mutex);
+        bool value = *flag;
+        dmMutex::Unlock(mutex);
+
+        if (value) { return true; }
+        if (dmTime::GetTime() >= deadline) { return false; }
+        dmTime::Sleep(1000);
+    }
+}
+
+bool DiscordRich_isShutdownPending()
+{
+    if (!task.pending) { return false; }
+
+    dmMutex::Lock(task.mutex);
+    bool done = task.done;
+    dmMutex::Unlock(task.mutex);
+
+    if (done) {
+        dmThread::Join(task.thread);
+        task.pending = false;
+    }
+    return task.pending;
+}
+
+bool DiscordRich_shutdownLibrary(uint64_t deadline)
+{
+    if (DiscordRich_isShutdownPending()) { return false; }
+    if (!DiscordRich_backend->shutdown) { return true; }
+
+    if (!task.mutex) {
+        task.mutex = dmMutex::New();
+    }
+
+    task.done = false;
+    task.pending = true;
+    task.shutdown = DiscordRich_backend->shutdown;
+    task.thread = dmThread::New(shutdownThread, 0x10000, NULL, "discordrich_shutdown");
+
+    if (!DiscordRich_waitForFlag(task.mutex, &task.done, deadline)) {
+        dmLogWarning("Discord_Shutdown() did not finish in time. Abandoning it");
+        return false;
+    }
+
+    dmThread::Join(task.thread);
+    task.pending = false;
+    return true;
+}
+
+#endif
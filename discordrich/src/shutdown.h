@@ -0,0 +1,22 @@
+#ifndef _SHUTDOWN_H_
+#define _SHUTDOWN_H_
+
+#include "common.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+// Calls Discord_Shutdown() on a helper thread and waits for it until deadline
+// (in dmTime::GetTime() microseconds). If the library doesn't finish in time
+// (eg. its IO thread is stuck on a half-open socket), the helper thread is
+// abandoned and false is returned.
+bool DiscordRich_shutdownLibrary(uint64_t deadline);
+
+// True while an abandoned Discord_Shutdown() call is still running. The
+// library must not be initialized again or unloaded until it finishes.
+bool DiscordRich_isShutdownPending();
+
+// Waits until *flag is set (read under mutex) or the deadline passes
+bool DiscordRich_waitForFlag(dmMutex::HMutex mutex, const bool * flag, uint64_t deadline);
+
+#endif
+#endif
@@ -0,0 +1,349 @@
+#include "template.h"
+#include "presence.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define MAX_SEPARATOR 8
+
+enum OpType {
+    OP_LITERAL,
+    OP_VALUE,
+};
+
+enum ValueFormat {
+    FORMAT_DEFAULT,
+    FORMAT_INTEGER,
+    FORMAT_FIXED,
+    FORMAT_GROUPED,
+};
+
+struct TemplateOp {
+    uint8_t type;
+    uint8_t format;
+    uint8_t precision;
+    uint8_t value;      // Index of the value, for OP_VALUE
+    uint32_t offset;    // Into literals, for OP_LITERAL
+    uint32_t length;
+};
+
+struct Template {
+    dmhash_t hash;
+    int valueCount;
+    dmArray<TemplateOp> ops;
+    char * literals;
+};
+
+static dmArray<Template *> templates;
+static char groupSeparator[MAX_SEPARATOR] = ",";
+static char decimalSeparator[MAX_SEPARATOR] = ".";
+
+static void copySeparator(char * dest, const char * src)
+{
+    strncpy(dest, src, MAX_SEPARATOR - 1);
+    dest[MAX_SEPARATOR - 1] = 0;
+}
+
+void DiscordRich_setNumberFormat(const char * group, const char * decimal)
+{
+    if (group) { copySeparator(groupSeparator, group); }
+    if (decimal) { copySeparator(decimalSeparator, decimal); }
+}
+
+// Compiling
+
+static void pushOp(Template * tpl, const TemplateOp & op)
+{
+    if (tpl->ops.Full()) {
+        tpl->ops.OffsetCapacity(8);
+    }
+    tpl->ops.Push(op);
+}
+
+static void appendLiteral(Template * tpl, uint32_t * literalsLen, char c)
+{
+    uint32_t count = tpl->ops.Size();
+    if (!count || tpl->ops[count - 1].type != OP_LITERAL) {
+        TemplateOp op;
+        memset(&op, 0, sizeof(op));
+        op.type = OP_LITERAL;
+        op.offset = *literalsLen;
+        pushOp(tpl, op);
+        count += 1;
+    }
+    tpl->literals[(*literalsLen)++] = c;
+    tpl->ops[count - 1].length += 1;
+}
+
+static bool isNameChar(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static bool parseSpec(const char * spec, size_t len, TemplateOp * op)
+{
+    op->format = FORMAT_DEFAULT;
+    op->precision = 0;
+    if (!len) { return true; }
+
+    size_t i = 0;
+    bool hasPrecision = false;
+    if (spec[i] == '.') {
+        i += 1;
+        int precision = 0;
+        while (i < len && spec[i] >= '0' && spec[i] <= '9') {
+            precision = precision * 10 + (spec[i] - '0');
+            if (precision > 20) { return false; }
+            i += 1;
+            hasPrecision = true;
+        }
+        if (!hasPrecision) { return false; }
+        op->precision = (uint8_t)precision;
+    }
+
+    if (i + 1 != len) { return false; }
+    switch (spec[i]) {
+        case 'd':
+            if (hasPrecision) { return false; }
+            op->format = FORMAT_INTEGER;
+            return true;
+        case 'f':
+            if (!hasPrecision) { return false; }
+            op->format = FORMAT_FIXED;
+            return true;
+        case 'n':
+            op->format = FORMAT_GROUPED;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void freeTemplate(Template * tpl)
+{
+    delete[] tpl->literals;
+    delete tpl;
+}
+
+uint32_t DiscordRich_compileTemplate(const char * format, char * error, size_t errorSize)
+{
+    size_t formatLen = strlen(format);
+    dmhash_t hash = dmHashBuffer64(format, (uint32_t)formatLen);
+    for (uint32_t i = 0; i < templates.Size(); i++) {
+        if (templates[i]->hash == hash) { return i + 1; }
+    }
+
+    Template * tpl = new Template;
+    tpl->hash = hash;
+    tpl->valueCount = 0;
+    tpl->literals = new char[formatLen + 1];
+    uint32_t literalsLen = 0;
+
+    const char * names[DISCORDRICH_TEMPLATE_MAX_VALUES];
+    size_t nameLens[DISCORDRICH_TEMPLATE_MAX_VALUES];
+
+    for (size_t i = 0; i < formatLen; i++) {
+        char c = format[i];
+
+        if (c == '}') {
+            if (format[i + 1] != '}') {
+                snprintf(error, errorSize, "unmatched '}' at position %d", (int)i + 1);
+                freeTemplate(tpl);
+                return 0;
+            }
+            appendLiteral(tpl, &literalsLen, '}');
+            i += 1;
+            continue;
+        }
+
+        if (c != '{') {
+            appendLiteral(tpl, &literalsLen, c);
+            continue;
+        }
+
+        if (format[i + 1] == '{') {
+            appendLiteral(tpl, &literalsLen, '{');
+            i += 1;
+            continue;
+        }
+
+        const char * name = format + i + 1;
+        const char * end = strchr(name, '}');
+        if (!end) {
+            snprintf(error, errorSize, "unmatched '{' at position %d", (int)i + 1);
+            freeTemplate(tpl);
+            return 0;
+        }
+
+        size_t nameLen = 0;
+        while (name + nameLen < end && isNameChar(name[nameLen])) { nameLen += 1; }
+        const char * spec = name + nameLen;
+        size_t specLen = end - spec;
+        if (specLen && *spec == ':') {
+            spec += 1;
+            specLen -= 1;
+        } else if (specLen) {
+            nameLen = 0;
+        }
+
+        TemplateOp op;
+        memset(&op, 0, sizeof(op));
+        op.type = OP_VALUE;
+        if (!nameLen || !parseSpec(spec, specLen, &op)) {
+            snprintf(error, errorSize, "invalid placeholder \"%.*s\"", (int)(end - name + 2), name - 1);
+            freeTemplate(tpl);
+            return 0;
+        }
+
+        int value = 0;
+        while (value < tpl->valueCount && (nameLens[value] != nameLen || strncmp(names[value], name, nameLen))) {
+            value += 1;
+        }
+        if (value == tpl->valueCount) {
+            if (value == DISCORDRICH_TEMPLATE_MAX_VALUES) {
+                snprintf(error, errorSize, "too many placeholders (max %d)", DISCORDRICH_TEMPLATE_MAX_VALUES);
+                freeTemplate(tpl);
+                return 0;
+            }
+            names[value] = name;
+            nameLens[value] = nameLen;
+            tpl->valueCount += 1;
+        }
+        op.value = (uint8_t)value;
+        pushOp(tpl, op);
+
+        i = end - format;
+    }
+
+    if (templates.Full()) {
+        templates.OffsetCapacity(16);
+    }
+    templates.Push(tpl);
+    return templates.Size();
+}
+
+int DiscordRich_getTemplateValueCount(uint32_t id)
+{
+    if (!id || id > templates.Size()) { return -1; }
+    return templates[id - 1]->valueCount;
+}
+
+void DiscordRich_freeTemplates()
+{
+    for (uint32_t i = 0; i < templates.Size(); i++) {
+        freeTemplate(templates[i]);
+    }
+    templates.SetSize(0);
+}
+
+// Rendering
+
+struct Writer {
+    char * buffer;
+    size_t size;
+    size_t length;
+    bool truncated;
+};
+
+static void append(Writer * w, const char * str, size_t len)
+{
+    size_t available = w->size - 1 - w->length;
+    if (len > available) {
+        len = available;
+        w->truncated = true;
+    }
+    memcpy(w->buffer + w->length, str, len);
+    w->length += len;
+}
+
+// Inserts the group separator in the integer part and swaps the decimal separator
+static void appendNumber(Writer * w, const char * digits, bool grouped)
+{
+    const char * start = digits;
+    if (*start == '-') {
+        append(w, "-", 1);
+        start += 1;
+    }
+
+    size_t intLen = 0;
+    while (start[intLen] >= '0' && start[intLen] <= '9') { intLen += 1; }
+
+    size_t groupLen = strlen(groupSeparator);
+    for (size_t i = 0; i < intLen; i++) {
+        append(w, start + i, 1);
+        size_t remaining = intLen - i - 1;
+        if (grouped && groupLen && remaining && remaining % 3 == 0) {
+            append(w, groupSeparator, groupLen);
+        }
+    }
+
+    const char * rest = start + intLen;
+    if (*rest == '.') {
+        append(w, decimalSeparator, strlen(decimalSeparator));
+        rest += 1;
+    }
+    append(w, rest, strlen(rest));
+}
+
+static void appendValue(Writer * w, const TemplateOp * op, const DiscordRich_TemplateValue * value)
+{
+    if (value->isString) {
+        append(w, value->string, value->length);
+        return;
+    }
+
+    char digits[64];
+    double number = value->number;
+    switch (op->format) {
+        case FORMAT_INTEGER:
+            snprintf(digits, sizeof(digits), "%.0f", number);
+            break;
+        case FORMAT_FIXED:
+        case FORMAT_GROUPED:
+            snprintf(digits, sizeof(digits), "%.*f", (int)op->precision, number);
+            break;
+        default:
+            if (number == floor(number) && fabs(number) < 1e15) {
+                snprintf(digits, sizeof(digits), "%.0f", number);
+            } else {
+                snprintf(digits, sizeof(digits), "%g", number);
+            }
+            break;
+    }
+
+    // inf, nan and exponents are left as they are
+    if (strpbrk(digits, "ein")) {
+        append(w, digits, strlen(digits));
+        return;
+    }
+    appendNumber(w, digits, op->format == FORMAT_GROUPED);
+}
+
+size_t DiscordRich_renderTemplate(uint32_t id, const DiscordRich_TemplateValue * values, int valueCount, char * buffer, size_t bufferSize)
+{
+    if (!bufferSize) { return 0; }
+    buffer[0] = 0;
+    if (!id || id > templates.Size()) { return 0; }
+
+    Template * tpl = templates[id - 1];
+    Writer w = { buffer, bufferSize, 0, false };
+
+    for (uint32_t i = 0; i < tpl->ops.Size() && !w.truncated; i++) {
+        const TemplateOp * op = &tpl->ops[i];
+        if (op->type == OP_LITERAL) {
+            append(&w, tpl->literals + op->offset, op->length);
+        } else if (op->value < valueCount) {
+            appendValue(&w, op, &values[op->value]);
+        }
+    }
+
+    // Drop a UTF-8 sequence that was cut in half by the truncation
+    if (w.truncated) { w.length = DiscordRich_trimUtf8(w.buffer, w.length); }
+    buffer[w.length] = 0;
+    return w.length;
+}
+
+#endif
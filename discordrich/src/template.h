@@ -0,0 +1,44 @@
+#ifndef _TEMPLATE_H_
+#define _TEMPLATE_H_
+
+#include "common.h"
+
+#ifdef DISCORD_RPC_SUPPORTED
+
+// Presence string templates, like "Wave {wave} - {score:n}". They are parsed
+// once into a list of ops and rendered straight into a fixed-size buffer.
+//
+// Placeholders are numbered in the order their names first appear, and that's
+// the order the values are expected in. Format specs:
+//   {x}      numbers without decimals when integral, strings as they are
+//   {x:d}    integer
+//   {x:.2f}  fixed number of decimals
+//   {x:n}    integer with digit grouping ({x:.2n} with decimals)
+// "{{" and "}}" are literal braces.
+
+#define DISCORDRICH_TEMPLATE_MAX_VALUES 16
+
+struct DiscordRich_TemplateValue {
+    bool isString;
+    double number;
+    const char * string;
+    size_t length;
+};
+
+// Compiling the same format twice returns the same id. Returns 0 and fills
+// error on parse errors
+uint32_t DiscordRich_compileTemplate(const char * format, char * error, size_t errorSize);
+
+// Number of distinct placeholders. -1 if the template doesn't exist
+int DiscordRich_getTemplateValueCount(uint32_t id);
+
+// Renders into buffer, truncating on a UTF-8 character boundary. Missing
+// values render as empty. Returns the length of the result
+size_t DiscordRich_renderTemplate(uint32_t id, const DiscordRich_TemplateValue * values, int valueCount, char * buffer, size_t bufferSize);
+
+void DiscordRich_setNumberFormat(const char * groupSeparator, const char * decimalSeparator);
+
+void DiscordRich_freeTemplates();
+
+#endif
+#endif
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Runs the presence broker test (broker.script) in two headless engine processes
+# sharing one Discord connection, with the recording backend.
+#
+# Usage: example/broker/run.sh path/to/dmengine_headless path/to/game.projectc
+#
+# Build the project first (eg. bob.jar build) so that game.projectc and the
+# compiled collections exist. Linux only, like the broker itself.
+
+set -u
+
+if [ $# -ne 2 ]; then
+    echo "usage: $0 <dmengine_headless> <game.projectc>" >&2
+    exit 2
+fi
+
+ENGINE="$1"
+PROJECT="$2"
+
+run() {
+    "$ENGINE" \
+        --config=bootstrap.main_collection=/example/broker/broker.collectionc \
+        --config=discordrich.backend=recording \
+        --config=discordrich.broker=1 \
+        --config=broker_test.role="$1" \
+        "$PROJECT"
+}
+
+run game &
+GAME=$!
+# Let the game claim the connection before the reporter starts
+sleep 1
+run reporter &
+REPORTER=$!
+
+wait $GAME
+GAME_STATUS=$?
+wait $REPORTER
+REPORTER_STATUS=$?
+
+if [ $GAME_STATUS -ne 0 ] || [ $REPORTER_STATUS -ne 0 ]; then
+    echo "broker test failed (game: $GAME_STATUS, reporter: $REPORTER_STATUS)" >&2
+    exit 1
+fi
+echo "broker test passed"
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Runs the capture/replay test (replay.script) in a headless engine, with the
+# recording backend. Pass a capture file to benchmark its replay instead.
+#
+# Usage: example/replay/run.sh path/to/dmengine_headless path/to/game.projectc [capture.bin]
+#
+# Build the project first (eg. bob.jar build) so that game.projectc and the
+# compiled collections exist.
+
+set -u
+
+if [ $# -lt 2 ] || [ $# -gt 3 ]; then
+    echo "usage: $0 <dmengine_headless> <game.projectc> [capture.bin]" >&2
+    exit 2
+fi
+
+"$1" \
+    --config=bootstrap.main_collection=/example/replay/replay.collectionc \
+    --config=discordrich.backend=recording \
+    --config=replay_test.path="${3:-}" \
+    "$2"